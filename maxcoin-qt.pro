@@ -182,7 +182,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/headerhash.h \
+    src/hashmap.h \
     src/uint256.h \
+    src/arith_uint256.h \
     src/serialize.h \
     src/main.h \
     src/net.h \
@@ -263,6 +266,7 @@ SOURCES += src/qt/bitcoin.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/headerhash.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
@@ -0,0 +1,209 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ARITH_UINT256_H
+#define BITCOIN_ARITH_UINT256_H
+
+#include "uint256.h"
+
+#include <stdexcept>
+
+/** 256-bit unsigned integer with the arithmetic used for targets and
+ * chain work.
+ *
+ * Unlike CBigNum it lives on the stack and never allocates.  Results wrap
+ * modulo 2^256 unless noted otherwise; callers keep values in range.
+ * SetCompact and GetCompact give the same results as the CBigNum
+ * versions for non-negative values.
+ */
+class arith_uint256 : public base_uint256
+{
+public:
+    arith_uint256()
+    {
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint256(uint64 b)
+    {
+        pn[0] = (unsigned int)b;
+        pn[1] = (unsigned int)(b >> 32);
+        for (int i = 2; i < WIDTH; i++)
+            pn[i] = 0;
+    }
+
+    arith_uint256(const base_uint256& b)
+    {
+        memcpy(pn, b.begin(), sizeof(pn));
+    }
+
+    arith_uint256& operator=(const base_uint256& b)
+    {
+        memcpy(pn, b.begin(), sizeof(pn));
+        return *this;
+    }
+
+    arith_uint256& operator=(uint64 b)
+    {
+        base_uint256::operator=(b);
+        return *this;
+    }
+
+    uint256 getuint256() const
+    {
+        uint256 ret;
+        memcpy(ret.begin(), pn, sizeof(pn));
+        return ret;
+    }
+
+    /** Number of significant bits */
+    unsigned int bits() const
+    {
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            if (pn[i] == 0)
+                continue;
+            for (int nBits = 31; nBits > 0; nBits--)
+                if (pn[i] & (1U << nBits))
+                    return 32 * i + nBits + 1;
+            return 32 * i + 1;
+        }
+        return 0;
+    }
+
+    arith_uint256& operator*=(unsigned int nMul)
+    {
+        uint64 nCarry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = (uint64)pn[i] * nMul + nCarry;
+            pn[i] = (unsigned int)n;
+            nCarry = n >> 32;
+        }
+        return *this;
+    }
+
+    /** Divide, rounding down, by shift and subtract */
+    arith_uint256& operator/=(const arith_uint256& b)
+    {
+        arith_uint256 num(*this);
+        arith_uint256 div(b);
+        *this = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0)
+            throw std::runtime_error("arith_uint256::operator/= : division by zero");
+        if (nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        while (nShift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+            nShift--;
+        }
+        return *this;
+    }
+
+    /** Divide by a 32-bit value, rounding down */
+    arith_uint256& operator/=(unsigned int nDiv)
+    {
+        uint64 nRem = 0;
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            uint64 n = (nRem << 32) | pn[i];
+            pn[i] = (unsigned int)(n / nDiv);
+            nRem = n % nDiv;
+        }
+        return *this;
+    }
+
+    /** Set to *this * nMul / nDiv rounded down, with a 288-bit intermediate
+     *  product so nothing is lost before the division.  Returns false, and
+     *  leaves *this unchanged, if the result does not fit in 256 bits. */
+    bool MulDiv(unsigned int nMul, unsigned int nDiv)
+    {
+        unsigned int pnProduct[WIDTH + 1];
+        uint64 nCarry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = (uint64)pn[i] * nMul + nCarry;
+            pnProduct[i] = (unsigned int)n;
+            nCarry = n >> 32;
+        }
+        pnProduct[WIDTH] = (unsigned int)nCarry;
+
+        uint64 nRem = 0;
+        for (int i = WIDTH; i >= 0; i--)
+        {
+            uint64 n = (nRem << 32) | pnProduct[i];
+            pnProduct[i] = (unsigned int)(n / nDiv);
+            nRem = n % nDiv;
+        }
+        if (pnProduct[WIDTH] != 0)
+            return false;
+        memcpy(pn, pnProduct, sizeof(pn));
+        return true;
+    }
+
+    /** Decode the compact ("nBits") representation.  pfNegative and
+     *  pfOverflow report values this type cannot hold; *this is then
+     *  meaningless. */
+    arith_uint256& SetCompact(unsigned int nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    unsigned int GetCompact() const
+    {
+        int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = (unsigned int)(Get64() << 8 * (3 - nSize));
+        else
+        {
+            arith_uint256 bn(*this);
+            bn >>= 8 * (nSize - 3);
+            nCompact = (unsigned int)bn.Get64();
+        }
+        // The 0x00800000 bit denotes the sign, so if it is already set,
+        // divide the mantissa by 256 and increase the exponent
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        return nCompact;
+    }
+};
+
+inline const arith_uint256 operator*(const arith_uint256& a, unsigned int b) { return arith_uint256(a) *= b; }
+inline const arith_uint256 operator/(const arith_uint256& a, unsigned int b) { return arith_uint256(a) /= b; }
+inline const arith_uint256 operator/(const arith_uint256& a, const arith_uint256& b) { return arith_uint256(a) /= b; }
+
+#endif
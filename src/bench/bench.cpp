@@ -0,0 +1,174 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <iostream>
+#include <new>
+#include <stdlib.h>
+
+using namespace json_spirit;
+
+// Count every operator new in the process, so benchmarks can report
+// allocations per operation.  Allocations made with malloc directly (for
+// example inside LevelDB or OpenSSL) are not counted.
+static volatile uint64 nAllocations = 0;
+
+// No exception specifications: they are deprecated, and the replacement
+// functions take those of the declarations in <new> anyway.
+void* operator new(size_t n)
+{
+    __sync_fetch_and_add(&nAllocations, 1);
+    void* p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t n)
+{
+    return operator new(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&)
+{
+    __sync_fetch_and_add(&nAllocations, 1);
+    return malloc(n ? n : 1);
+}
+
+void* operator new[](size_t n, const std::nothrow_t& nt)
+{
+    return operator new(n, nt);
+}
+
+void operator delete(void* p) { free(p); }
+void operator delete[](void* p) { free(p); }
+void operator delete(void* p, size_t) { free(p); }
+void operator delete[](void* p, size_t) { free(p); }
+void operator delete(void* p, const std::nothrow_t&) { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) { free(p); }
+
+namespace benchmark {
+
+uint64 GetAllocationCount()
+{
+    return nAllocations;
+}
+
+State::State(const std::string& strNameIn, int64 nMaxTimeIn) :
+    strName(strNameIn), nMaxTime(nMaxTimeIn), nMaxIterations(~(uint64)0), nCount(0), nCountMask(0),
+    nBeginTime(0), nEndTime(0), nBeginAllocs(0), nEndAllocs(0), nBytesPerOp(0), nItemsPerOp(0)
+{
+}
+
+bool State::KeepRunning()
+{
+    if (nCount == 0) {
+        if (nMaxIterations == 0)
+            return false;
+        nBeginAllocs = GetAllocationCount();
+        nBeginTime = nEndTime = GetTimeMicros();
+        nCount = 1;
+        return true;
+    }
+    if (nCount >= nMaxIterations) {
+        nEndTime = GetTimeMicros();
+        nEndAllocs = GetAllocationCount();
+        return false;
+    }
+    if (nCount & nCountMask) {
+        nCount++;
+        return true;
+    }
+
+    int64 nNow = GetTimeMicros();
+    if (nNow - nBeginTime >= nMaxTime) {
+        nEndTime = nNow;
+        nEndAllocs = GetAllocationCount();
+        return false;
+    }
+    // Look at the clock less often while the time since the last look is
+    // small compared to the budget
+    if ((nNow - nEndTime) * 256 < nMaxTime && nCountMask < 0xfffff && nMaxIterations == ~(uint64)0)
+        nCountMask = nCountMask * 2 + 1;
+    nEndTime = nNow;
+    nCount++;
+    return true;
+}
+
+double State::GetNanosPerOp() const
+{
+    return nCount ? 1000.0 * (nEndTime - nBeginTime) / nCount : 0;
+}
+
+double State::GetAllocsPerOp() const
+{
+    return nCount ? (double)(nEndAllocs - nBeginAllocs) / nCount : 0;
+}
+
+BenchRunner::BenchmarkMap& BenchRunner::Benchmarks()
+{
+    static BenchmarkMap benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const std::string& strName, BenchFunction func)
+{
+    Benchmarks().insert(std::make_pair(strName, func));
+}
+
+void BenchRunner::RunAll(const std::string& strFilter, int64 nMaxTimeMillis, bool fJSON)
+{
+    Array results;
+    if (!fJSON)
+        std::cout << strprintf("%-28s %12s %14s %14s %16s %12s\n", "# benchmark", "iterations", "ns/op", "ops/s", "throughput", "allocs/op");
+
+    for (BenchmarkMap::const_iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == std::string::npos)
+            continue;
+
+        State state(it->first, nMaxTimeMillis * 1000);
+        it->second(state);
+
+        double dNanos = state.GetNanosPerOp();
+        double dOpsPerSec = dNanos > 0 ? 1e9 / dNanos : 0;
+        if (fJSON)
+        {
+            Object result;
+            result.push_back(Pair("name", state.GetName()));
+            result.push_back(Pair("iterations", (boost::int64_t)state.GetIterations()));
+            result.push_back(Pair("ns_per_op", dNanos));
+            result.push_back(Pair("ops_per_sec", dOpsPerSec));
+            if (state.GetBytesPerOp())
+                result.push_back(Pair("bytes_per_sec", dOpsPerSec * state.GetBytesPerOp()));
+            if (state.GetItemsPerOp())
+                result.push_back(Pair("items_per_sec", dOpsPerSec * state.GetItemsPerOp()));
+            result.push_back(Pair("allocs_per_op", state.GetAllocsPerOp()));
+            results.push_back(result);
+        }
+        else
+        {
+            std::string strThroughput = "-";
+            if (state.GetBytesPerOp())
+                strThroughput = strprintf("%.2f MB/s", dOpsPerSec * state.GetBytesPerOp() / 1e6);
+            else if (state.GetItemsPerOp())
+                strThroughput = strprintf("%.0f items/s", dOpsPerSec * state.GetItemsPerOp());
+            std::cout << strprintf("%-28s %12"PRI64u" %14.1f %14.1f %16s %12.2f\n", state.GetName().c_str(),
+                                   state.GetIterations(), dNanos, dOpsPerSec, strThroughput.c_str(), state.GetAllocsPerOp());
+        }
+    }
+
+    if (fJSON)
+    {
+        Object report;
+        report.push_back(Pair("version", FormatFullVersion()));
+        report.push_back(Pair("time", (boost::int64_t)GetTime()));
+        report.push_back(Pair("benchmarks", results));
+        std::cout << write_string(Value(report), true) << std::endl;
+    }
+}
+
+}
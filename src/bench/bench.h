@@ -0,0 +1,97 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include "util.h"
+
+#include <limits>
+#include <map>
+#include <string>
+
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/** Timing harness for bench_maxcoin.
+ *
+ * A benchmark is a function taking a State and running its operation in a
+ * loop while State::KeepRunning() returns true:
+ *
+ *     static void HashHeader(benchmark::State& state)
+ *     {
+ *         CBlockHeader header;
+ *         while (state.KeepRunning())
+ *             header.GetHash();
+ *     }
+ *     BENCHMARK(HashHeader);
+ *
+ * The loop runs for about -time milliseconds, or for at most the number of
+ * iterations set with SetMaxIterations, for benchmarks that consume
+ * prepared inputs; SetFixedIterations ignores the time limit.  Setup
+ * before the loop is not timed.
+ */
+namespace benchmark {
+
+class State
+{
+private:
+    std::string strName;
+    int64 nMaxTime;          // microseconds
+    uint64 nMaxIterations;
+    uint64 nCount;
+    uint64 nCountMask;
+    int64 nBeginTime;
+    int64 nEndTime;
+    uint64 nBeginAllocs;
+    uint64 nEndAllocs;
+    uint64 nBytesPerOp;
+    uint64 nItemsPerOp;
+
+public:
+    State(const std::string& strNameIn, int64 nMaxTimeIn);
+
+    bool KeepRunning();
+
+    /** Stop after n iterations even if time remains */
+    void SetMaxIterations(uint64 n) { nMaxIterations = n; }
+    /** Run exactly n iterations, however long they take */
+    void SetFixedIterations(uint64 n) { nMaxIterations = n; nMaxTime = std::numeric_limits<int64>::max(); }
+    /** Report throughput in bytes per second, n bytes per iteration */
+    void SetBytesPerOp(uint64 n) { nBytesPerOp = n; }
+    /** Report throughput in items per second, n items per iteration */
+    void SetItemsPerOp(uint64 n) { nItemsPerOp = n; }
+
+    const std::string& GetName() const { return strName; }
+    uint64 GetIterations() const { return nCount; }
+    double GetNanosPerOp() const;
+    double GetAllocsPerOp() const;
+    uint64 GetBytesPerOp() const { return nBytesPerOp; }
+    uint64 GetItemsPerOp() const { return nItemsPerOp; }
+};
+
+typedef void (*BenchFunction)(State&);
+
+class BenchRunner
+{
+private:
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& Benchmarks();
+
+public:
+    BenchRunner(const std::string& strName, BenchFunction func);
+
+    /** Run the benchmarks whose name contains strFilter and print the
+     *  results, as a table or as JSON */
+    static void RunAll(const std::string& strFilter, int64 nMaxTimeMillis, bool fJSON);
+};
+
+/** Number of operator new calls so far in this process */
+uint64 GetAllocationCount();
+
+}
+
+#define BENCHMARK(n) \
+    static benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif
@@ -0,0 +1,63 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "main.h"
+#include "wallet.h"
+#include "ui_interface.h"
+
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void StartShutdown()
+{
+    exit(0);
+}
+bool ShutdownRequested()
+{
+    return false;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        std::cout << "Usage: bench_maxcoin [options]\n"
+                     "  -filter=<str>   Only run benchmarks whose name contains <str>\n"
+                     "  -time=<n>       Run each benchmark for about <n> milliseconds (default: 500)\n"
+                     "  -json           Print the results as JSON\n"
+                     "  -par=<n>        Number of script verification threads (default: 0 = auto)\n"
+                     "  -blocks=<n>     Blocks in the ConnectBlock benchmark (default: 20)\n"
+                     "  -txs=<n>        Transactions per block in the ConnectBlock benchmark (default: 100)\n";
+        return 0;
+    }
+
+    // Keep databases and any files benchmarks write out of the real data directory
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("bench_maxcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+
+    boost::thread_group threadGroup;
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    for (int i=0; i<nScriptCheckThreads-1; i++)
+        threadGroup.create_thread(&ThreadScriptCheck);
+
+    benchmark::BenchRunner::RunAll(GetArg("-filter", ""), GetArg("-time", 500), GetBoolArg("-json"));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    boost::filesystem::remove_all(pathTemp);
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "main.h"
+
+// A block of nTx one-in, two-out transactions with dummy scripts
+static void MakeBlock(CBlock& block, unsigned int nTx)
+{
+    block.vtx.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction& tx = block.vtx[i];
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << std::vector<unsigned char>(33, 0x02);
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < 2; j++)
+        {
+            tx.vout[j].nValue = COIN;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        tx.InvalidateHash();
+    }
+    block.nTime = GetTime();
+}
+
+static void BlockMerkleRoot(benchmark::State& state)
+{
+    CBlock block;
+    MakeBlock(block, 1000);
+    state.SetItemsPerOp(block.vtx.size());
+    while (state.KeepRunning())
+        block.BuildMerkleTree();
+}
+BENCHMARK(BlockMerkleRoot);
+
+static void BlockSerialize(benchmark::State& state)
+{
+    CBlock block;
+    MakeBlock(block, 1000);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    state.SetBytesPerOp(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    while (state.KeepRunning())
+    {
+        ss.clear();
+        ss << block;
+    }
+}
+BENCHMARK(BlockSerialize);
+
+static void BlockDeserialize(benchmark::State& state)
+{
+    CBlock block;
+    MakeBlock(block, 1000);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    state.SetBytesPerOp(ssBlock.size());
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssBlock);
+        CBlock blockRead;
+        ss >> blockRead;
+    }
+}
+BENCHMARK(BlockDeserialize);
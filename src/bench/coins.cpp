@@ -0,0 +1,185 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "main.h"
+#include "checkpoints.h"
+#include "keystore.h"
+#include "txdb.h"
+
+/** Unspent outputs paying to one key, and signed transactions spending them */
+class CSpendSet
+{
+public:
+    CBasicKeyStore keystore;
+    CScript scriptPubKey;
+    std::vector<CTransaction> vtxFrom;
+    std::vector<CTransaction> vtxSpend;
+
+    CSpendSet(unsigned int nCount)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+        vtxFrom.resize(nCount);
+        vtxSpend.resize(nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            CTransaction& txFrom = vtxFrom[i];
+            txFrom.vin.resize(1);
+            txFrom.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            txFrom.vout.resize(1);
+            txFrom.vout[0].nValue = COIN;
+            txFrom.vout[0].scriptPubKey = scriptPubKey;
+            txFrom.InvalidateHash();
+
+            CTransaction& txSpend = vtxSpend[i];
+            txSpend.vin.resize(1);
+            txSpend.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+            txSpend.vout.resize(1);
+            txSpend.vout[0].nValue = COIN - CENT;
+            txSpend.vout[0].scriptPubKey = scriptPubKey;
+            SignSignature(keystore, txFrom, txSpend, 0);
+        }
+    }
+
+    // Add the spent outputs to view, as confirmed at nHeight
+    void AddCoins(CCoinsViewCache& view, int nHeight) const
+    {
+        for (unsigned int i = 0; i < vtxFrom.size(); i++)
+            view.SetCoins(vtxFrom[i].GetHash(), CCoins(vtxFrom[i], nHeight));
+    }
+};
+
+static void CoinsCacheHit(benchmark::State& state)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache cache(db);
+    std::vector<uint256> vHash(10000);
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.InvalidateHash();
+        vHash[i] = tx.GetHash();
+        cache.SetCoins(vHash[i], CCoins(tx, 1));
+    }
+    unsigned int i = 0;
+    while (state.KeepRunning())
+    {
+        if (cache.AccessCoins(vHash[i]).IsPruned())
+            throw std::runtime_error("CoinsCacheHit : coins missing");
+        if (++i == vHash.size())
+            i = 0;
+    }
+}
+BENCHMARK(CoinsCacheHit);
+
+static void CoinsCacheMiss(benchmark::State& state)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache cache(db);
+    uint256 hash = GetRandHash();
+    while (state.KeepRunning())
+    {
+        if (cache.HaveCoins(hash))
+            throw std::runtime_error("CoinsCacheMiss : unexpected coins");
+        ++*hash.begin();
+    }
+}
+BENCHMARK(CoinsCacheMiss);
+
+static void MempoolAccept(benchmark::State& state)
+{
+    CSpendSet spends(2000);
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache tip(db);
+    CBlockIndex indexDummy;
+    indexDummy.nHeight = 100;
+    spends.AddCoins(tip, 1);
+    tip.SetBestBlock(&indexDummy);
+    pcoinsTip = &tip;
+
+    unsigned int i = 0;
+    state.SetMaxIterations(spends.vtxSpend.size());
+    while (state.KeepRunning())
+    {
+        CValidationState stateAccept;
+        if (!mempool.accept(stateAccept, spends.vtxSpend[i++], true, false, NULL))
+            throw std::runtime_error("MempoolAccept : transaction rejected");
+    }
+
+    mempool.clear();
+    pcoinsTip = NULL;
+}
+BENCHMARK(MempoolAccept);
+
+// Connect a synthetic chain of -blocks blocks of -txs transactions each,
+// past the last checkpoint so scripts are verified, against an in-memory
+// chainstate; this covers transaction checks, script verification on the
+// -par threads and UTXO cache updates and flushes
+static void ConnectBlocks(benchmark::State& state)
+{
+    unsigned int nBlocks = std::max(GetArg("-blocks", 20), (int64)1);
+    unsigned int nTxs = std::max(GetArg("-txs", 100), (int64)1);
+    int nHeightStart = Checkpoints::GetTotalBlocksEstimate();
+
+    CSpendSet spends(nBlocks * nTxs);
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache tip(db);
+
+    std::vector<CBlock> vBlock(nBlocks);
+    std::vector<uint256> vHash(nBlocks + 1, 0);
+    std::vector<CBlockIndex> vIndex(nBlocks + 1);
+    vIndex[0].phashBlock = &vHash[0];
+    vIndex[0].nHeight = nHeightStart;
+    for (unsigned int b = 0; b < nBlocks; b++)
+    {
+        CBlock& block = vBlock[b];
+        block.vtx.resize(nTxs + 1);
+        CTransaction& txCoinbase = block.vtx[0];
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << (nHeightStart + b + 1) << OP_0;
+        txCoinbase.vout.resize(1);
+        txCoinbase.vout[0].nValue = 0;
+        txCoinbase.vout[0].scriptPubKey = spends.scriptPubKey;
+        txCoinbase.InvalidateHash();
+        for (unsigned int t = 0; t < nTxs; t++)
+            block.vtx[t + 1] = spends.vtxSpend[b * nTxs + t];
+        block.hashPrevBlock = vHash[b];
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = GetTime();
+        vHash[b + 1] = block.GetHash();
+
+        CBlockIndex& index = vIndex[b + 1];
+        index = CBlockIndex(block);
+        index.phashBlock = &vHash[b + 1];
+        index.pprev = &vIndex[b];
+        index.nHeight = nHeightStart + b + 1;
+    }
+    spends.AddCoins(tip, 1);
+    tip.SetBestBlock(&vIndex[0]);
+    tip.Flush();
+
+    unsigned int b = 0;
+    state.SetFixedIterations(nBlocks);
+    state.SetItemsPerOp(nTxs + 1);
+    while (state.KeepRunning())
+    {
+        CValidationState stateConnect;
+        CCoinsViewCache view(tip, true);
+        if (!vBlock[b].ConnectBlock(stateConnect, &vIndex[b + 1], view, true))
+            throw std::runtime_error("ConnectBlocks : ConnectBlock failed");
+        view.SetBestBlock(&vIndex[b + 1]);
+        view.Flush();
+        if (++b == nBlocks || tip.DynamicMemoryUsage() > nCoinCacheUsage)
+            tip.Flush();
+    }
+}
+BENCHMARK(ConnectBlocks);
@@ -0,0 +1,48 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "main.h"
+#include "headerhash.h"
+#include "hash.h"
+
+static void HashBlockHeader(benchmark::State& state)
+{
+    CBlockHeader header;
+    header.nTime = GetTime();
+    header.nBits = 0x1d00ffff;
+    state.SetBytesPerOp(HEADER_HASH_INPUT_SIZE);
+    while (state.KeepRunning())
+    {
+        header.GetHash();
+        header.nNonce++;
+    }
+}
+BENCHMARK(HashBlockHeader);
+
+static void HashHeaderNonces(benchmark::State& state)
+{
+    static const unsigned int nBatch = 64;
+    CBlockHeader header;
+    header.nTime = GetTime();
+    header.nBits = 0x1d00ffff;
+    CHeaderHasher hasher(header);
+    uint256 hashes[nBatch];
+    unsigned int nNonce = 0;
+    state.SetItemsPerOp(nBatch);
+    while (state.KeepRunning())
+    {
+        hasher.HashNonces(nNonce, nBatch, hashes);
+        nNonce += nBatch;
+    }
+}
+BENCHMARK(HashHeaderNonces);
+
+static void HashKeccak1K(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(1024, 0x5a);
+    state.SetBytesPerOp(vch.size());
+    while (state.KeepRunning())
+        vch[0] = *HashKeccak(vch.begin(), vch.end()).begin();
+}
+BENCHMARK(HashKeccak1K);
@@ -0,0 +1,34 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "key.h"
+#include "hash.h"
+
+static void KeySign(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    while (state.KeepRunning())
+    {
+        key.Sign(hash, vchSig);
+        hash = HashKeccak(vchSig.begin(), vchSig.end());
+    }
+}
+BENCHMARK(KeySign);
+
+static void KeyVerify(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning())
+        if (!pubkey.Verify(hash, vchSig))
+            throw std::runtime_error("KeyVerify : signature rejected");
+}
+BENCHMARK(KeyVerify);
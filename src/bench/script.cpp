@@ -0,0 +1,51 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "bench/bench.h"
+#include "main.h"
+#include "keystore.h"
+#include "script.h"
+
+// A signed spend of a pay-to-pubkey-hash output
+static void MakeSpend(CTransaction& txFrom, CTransaction& txTo)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    txFrom.vin.resize(1);
+    txFrom.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    txFrom.InvalidateHash();
+
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = COIN;
+    txTo.vout[0].scriptPubKey = txFrom.vout[0].scriptPubKey;
+    SignSignature(keystore, txFrom, txTo, 0);
+}
+
+static void VerifyScriptP2PKH(benchmark::State& state, unsigned int flags)
+{
+    CTransaction txFrom, txTo;
+    MakeSpend(txFrom, txTo);
+    while (state.KeepRunning())
+        if (!VerifyScript(txTo.vin[0].scriptSig, txFrom.vout[0].scriptPubKey, txTo, 0, flags, 0))
+            throw std::runtime_error("VerifyScriptP2PKH : script rejected");
+}
+
+static void VerifyScriptCached(benchmark::State& state)
+{
+    VerifyScriptP2PKH(state, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC);
+}
+BENCHMARK(VerifyScriptCached);
+
+static void VerifyScriptNoCache(benchmark::State& state)
+{
+    VerifyScriptP2PKH(state, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE);
+}
+BENCHMARK(VerifyScriptNoCache);
@@ -26,6 +26,14 @@
 #include <ifaddrs.h>
 #endif
 
+#ifdef __linux__
+// Use epoll instead of select() in ThreadSocketHandler
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
 typedef u_int SOCKET;
 #ifdef WIN32
 #define MSG_NOSIGNAL        0
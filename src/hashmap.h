@@ -0,0 +1,191 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_HASHMAP_H
+#define BITCOIN_HASHMAP_H
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+/** Approximate heap usage of one allocation of nAlloc bytes, including malloc overhead */
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+/** Hash table with open addressing and linear probing.
+ *
+ * Entries live in one flat array, so a lookup is a hash and usually a
+ * single cache miss, and there is no allocation per entry.  Erasing shifts
+ * the following entries of the probe sequence back instead of leaving
+ * tombstones.  Inserting or erasing invalidates iterators and references
+ * to other entries.  V must be default constructible and have a member
+ * swap(); Hasher maps a K to a size_t whose low bits are well mixed.
+ */
+template <typename K, typename V, typename Hasher>
+class COpenHashMap
+{
+public:
+    typedef std::pair<K, V> value_type;
+
+private:
+    std::vector<value_type> vSlots;
+    std::vector<unsigned char> vUsed;
+    size_t nSize;
+    size_t nMask;
+    Hasher hasher;
+
+    enum { MIN_CAPACITY = 16 };
+
+    size_t Slot(const K& key) const
+    {
+        return hasher(key) & nMask;
+    }
+
+    // Position of key, or of the empty slot where it would go
+    size_t Probe(const K& key) const
+    {
+        size_t nPos = Slot(key);
+        while (vUsed[nPos] && !(vSlots[nPos].first == key))
+            nPos = (nPos + 1) & nMask;
+        return nPos;
+    }
+
+    void Rehash(size_t nCapacity)
+    {
+        std::vector<value_type> vOldSlots(nCapacity);
+        std::vector<unsigned char> vOldUsed(nCapacity, 0);
+        vSlots.swap(vOldSlots);
+        vUsed.swap(vOldUsed);
+        nMask = nCapacity - 1;
+        for (size_t i = 0; i < vOldSlots.size(); i++)
+        {
+            if (!vOldUsed[i])
+                continue;
+            size_t nPos = Probe(vOldSlots[i].first);
+            vSlots[nPos].first = vOldSlots[i].first;
+            vSlots[nPos].second.swap(vOldSlots[i].second);
+            vUsed[nPos] = 1;
+        }
+    }
+
+    template <typename M, typename R, typename P>
+    class iterator_base
+    {
+    private:
+        M* pmap;
+        size_t nPos;
+
+        void Skip()
+        {
+            while (nPos < pmap->vUsed.size() && !pmap->vUsed[nPos])
+                nPos++;
+        }
+
+    public:
+        iterator_base() : pmap(NULL), nPos(0) {}
+        iterator_base(M* pmapIn, size_t nPosIn) : pmap(pmapIn), nPos(nPosIn) { Skip(); }
+        template <typename M2, typename R2, typename P2>
+        iterator_base(const iterator_base<M2, R2, P2>& it) : pmap(it.GetMap()), nPos(it.GetPos()) {}
+
+        M* GetMap() const { return pmap; }
+        size_t GetPos() const { return nPos; }
+
+        R operator*() const { return pmap->vSlots[nPos]; }
+        P operator->() const { return &pmap->vSlots[nPos]; }
+        iterator_base& operator++() { nPos++; Skip(); return *this; }
+        bool operator==(const iterator_base& it) const { return nPos == it.nPos; }
+        bool operator!=(const iterator_base& it) const { return nPos != it.nPos; }
+    };
+
+public:
+    typedef iterator_base<COpenHashMap, value_type&, value_type*> iterator;
+    typedef iterator_base<const COpenHashMap, const value_type&, const value_type*> const_iterator;
+
+    COpenHashMap() : vSlots(MIN_CAPACITY), vUsed(MIN_CAPACITY, 0), nSize(0), nMask(MIN_CAPACITY - 1) {}
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, vSlots.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, vSlots.size()); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const K& key)
+    {
+        size_t nPos = Probe(key);
+        return vUsed[nPos] ? iterator(this, nPos) : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        size_t nPos = Probe(key);
+        return vUsed[nPos] ? const_iterator(this, nPos) : end();
+    }
+
+    size_t count(const K& key) const
+    {
+        return vUsed[Probe(key)] ? 1 : 0;
+    }
+
+    // Find key, adding it with a default constructed value if it is missing;
+    // the bool is true if it was added
+    std::pair<iterator, bool> insert(const K& key)
+    {
+        // Keep the load factor at or below 3/4
+        if ((nSize + 1) * 4 > vSlots.size() * 3)
+            Rehash(vSlots.size() * 2);
+        size_t nPos = Probe(key);
+        if (vUsed[nPos])
+            return std::make_pair(iterator(this, nPos), false);
+        vSlots[nPos].first = key;
+        vUsed[nPos] = 1;
+        nSize++;
+        return std::make_pair(iterator(this, nPos), true);
+    }
+
+    void erase(iterator it)
+    {
+        size_t nHole = it.GetPos();
+        V().swap(vSlots[nHole].second);
+        vUsed[nHole] = 0;
+        nSize--;
+
+        // Move back entries whose probe sequence passes through the hole
+        for (size_t nPos = (nHole + 1) & nMask; vUsed[nPos]; nPos = (nPos + 1) & nMask)
+        {
+            size_t nHome = Slot(vSlots[nPos].first);
+            bool fStays = nHole <= nPos ? (nHole < nHome && nHome <= nPos) : (nHole < nHome || nHome <= nPos);
+            if (fStays)
+                continue;
+            vSlots[nHole].first = vSlots[nPos].first;
+            vSlots[nHole].second.swap(vSlots[nPos].second);
+            vUsed[nHole] = 1;
+            vUsed[nPos] = 0;
+            nHole = nPos;
+        }
+    }
+
+    // Remove all entries and give the table memory back
+    void clear()
+    {
+        std::vector<value_type>(MIN_CAPACITY).swap(vSlots);
+        std::vector<unsigned char>(MIN_CAPACITY, 0).swap(vUsed);
+        nSize = 0;
+        nMask = MIN_CAPACITY - 1;
+    }
+
+    // Heap memory used by the table itself, not by what the values own
+    size_t DynamicMemoryUsage() const
+    {
+        return MallocUsage(vSlots.capacity() * sizeof(value_type)) + MallocUsage(vUsed.capacity());
+    }
+};
+
+#endif
@@ -0,0 +1,357 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "headerhash.h"
+#include "main.h"
+
+#include <string.h>
+
+#include <boost/thread/once.hpp>
+
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))
+#define USE_KECCAK_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+//
+// Keccak-f[1600], written once over abstract lane operations so the same
+// round serves 64-bit scalars and 4- or 8-lane vectors:
+//   KXOR(a, b)     a ^ b
+//   KROL(a, n)     a rotated left by n bits, 0 < n < 64
+//   KCHI(a, b, c)  a ^ (~b & c)
+//   KRC(i)         round constant i, broadcast to every lane
+// A is the state, lane x + 5*y at A[x + 5*y]; B, C0..C4 and D0..D4 are
+// scratch declared by the caller.
+//
+static const uint64 pKeccakRoundConstants[24] =
+{
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+#define KECCAK_ROUND(i) do { \
+    C0 = KXOR(KXOR(KXOR(A[ 0], A[ 5]), KXOR(A[10], A[15])), A[20]); \
+    C1 = KXOR(KXOR(KXOR(A[ 1], A[ 6]), KXOR(A[11], A[16])), A[21]); \
+    C2 = KXOR(KXOR(KXOR(A[ 2], A[ 7]), KXOR(A[12], A[17])), A[22]); \
+    C3 = KXOR(KXOR(KXOR(A[ 3], A[ 8]), KXOR(A[13], A[18])), A[23]); \
+    C4 = KXOR(KXOR(KXOR(A[ 4], A[ 9]), KXOR(A[14], A[19])), A[24]); \
+    D0 = KXOR(C4, KROL(C1, 1)); \
+    D1 = KXOR(C0, KROL(C2, 1)); \
+    D2 = KXOR(C1, KROL(C3, 1)); \
+    D3 = KXOR(C2, KROL(C4, 1)); \
+    D4 = KXOR(C3, KROL(C0, 1)); \
+    B[ 0] = KXOR(A[ 0], D0); \
+    B[10] = KROL(KXOR(A[ 1], D1), 1); \
+    B[20] = KROL(KXOR(A[ 2], D2), 62); \
+    B[ 5] = KROL(KXOR(A[ 3], D3), 28); \
+    B[15] = KROL(KXOR(A[ 4], D4), 27); \
+    B[16] = KROL(KXOR(A[ 5], D0), 36); \
+    B[ 1] = KROL(KXOR(A[ 6], D1), 44); \
+    B[11] = KROL(KXOR(A[ 7], D2), 6); \
+    B[21] = KROL(KXOR(A[ 8], D3), 55); \
+    B[ 6] = KROL(KXOR(A[ 9], D4), 20); \
+    B[ 7] = KROL(KXOR(A[10], D0), 3); \
+    B[17] = KROL(KXOR(A[11], D1), 10); \
+    B[ 2] = KROL(KXOR(A[12], D2), 43); \
+    B[12] = KROL(KXOR(A[13], D3), 25); \
+    B[22] = KROL(KXOR(A[14], D4), 39); \
+    B[23] = KROL(KXOR(A[15], D0), 41); \
+    B[ 8] = KROL(KXOR(A[16], D1), 45); \
+    B[18] = KROL(KXOR(A[17], D2), 15); \
+    B[ 3] = KROL(KXOR(A[18], D3), 21); \
+    B[13] = KROL(KXOR(A[19], D4), 8); \
+    B[14] = KROL(KXOR(A[20], D0), 18); \
+    B[24] = KROL(KXOR(A[21], D1), 2); \
+    B[ 9] = KROL(KXOR(A[22], D2), 61); \
+    B[19] = KROL(KXOR(A[23], D3), 56); \
+    B[ 4] = KROL(KXOR(A[24], D4), 14); \
+    A[ 0] = KCHI(B[ 0], B[ 1], B[ 2]); \
+    A[ 1] = KCHI(B[ 1], B[ 2], B[ 3]); \
+    A[ 2] = KCHI(B[ 2], B[ 3], B[ 4]); \
+    A[ 3] = KCHI(B[ 3], B[ 4], B[ 0]); \
+    A[ 4] = KCHI(B[ 4], B[ 0], B[ 1]); \
+    A[ 5] = KCHI(B[ 5], B[ 6], B[ 7]); \
+    A[ 6] = KCHI(B[ 6], B[ 7], B[ 8]); \
+    A[ 7] = KCHI(B[ 7], B[ 8], B[ 9]); \
+    A[ 8] = KCHI(B[ 8], B[ 9], B[ 5]); \
+    A[ 9] = KCHI(B[ 9], B[ 5], B[ 6]); \
+    A[10] = KCHI(B[10], B[11], B[12]); \
+    A[11] = KCHI(B[11], B[12], B[13]); \
+    A[12] = KCHI(B[12], B[13], B[14]); \
+    A[13] = KCHI(B[13], B[14], B[10]); \
+    A[14] = KCHI(B[14], B[10], B[11]); \
+    A[15] = KCHI(B[15], B[16], B[17]); \
+    A[16] = KCHI(B[16], B[17], B[18]); \
+    A[17] = KCHI(B[17], B[18], B[19]); \
+    A[18] = KCHI(B[18], B[19], B[15]); \
+    A[19] = KCHI(B[19], B[15], B[16]); \
+    A[20] = KCHI(B[20], B[21], B[22]); \
+    A[21] = KCHI(B[21], B[22], B[23]); \
+    A[22] = KCHI(B[22], B[23], B[24]); \
+    A[23] = KCHI(B[23], B[24], B[20]); \
+    A[24] = KCHI(B[24], B[20], B[21]); \
+    A[ 0] = KXOR(A[ 0], KRC(i)); \
+} while (0)
+
+#define KECCAK_F1600() do { \
+    for (int nRound = 0; nRound < 24; nRound++) \
+        KECCAK_ROUND(nRound); \
+} while (0)
+
+static inline uint64 ReadLE64(const unsigned char* p)
+{
+    uint64 x = 0;
+    for (int i = 7; i >= 0; i--)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+static inline void WriteLE64(unsigned char* p, uint64 x)
+{
+    for (int i = 0; i < 8; i++, x >>= 8)
+        p[i] = (unsigned char)x;
+}
+
+// Pad an 80-byte header into the Keccak-256 rate: original Keccak padding,
+// 0x01 after the message and 0x80 in the last byte of the block.
+static void HeaderToLanes(const CBlockHeader& header, uint64* lanes)
+{
+    unsigned char block[HEADER_HASH_LANES * 8];
+    memset(block, 0, sizeof(block));
+    memcpy(block, BEGIN(header.nVersion), HEADER_HASH_INPUT_SIZE);
+    block[HEADER_HASH_INPUT_SIZE] = 0x01;
+    block[sizeof(block) - 1] |= 0x80;
+    for (unsigned int i = 0; i < HEADER_HASH_LANES; i++)
+        lanes[i] = ReadLE64(block + 8 * i);
+}
+
+static inline uint64 NonceLane(uint64 lane, unsigned int nNonce)
+{
+    return (lane & 0xFFFFFFFFULL) | ((uint64)nNonce << 32);
+}
+
+//
+// Scalar kernel: one header per call.
+//
+#define KXOR(a, b) ((a) ^ (b))
+#define KROL(a, n) (((a) << (n)) | ((a) >> (64 - (n))))
+#define KCHI(a, b, c) ((a) ^ (~(b) & (c)))
+#define KRC(i) pKeccakRoundConstants[i]
+
+static void KeccakLanes1(const uint64* const* pplanes, uint256* phashes)
+{
+    uint64 A[25], B[25];
+    uint64 C0, C1, C2, C3, C4, D0, D1, D2, D3, D4;
+    for (unsigned int i = 0; i < HEADER_HASH_LANES; i++)
+        A[i] = pplanes[0][i];
+    for (unsigned int i = HEADER_HASH_LANES; i < 25; i++)
+        A[i] = 0;
+    KECCAK_F1600();
+    unsigned char* pout = (unsigned char*)&phashes[0];
+    for (int i = 0; i < 4; i++)
+        WriteLE64(pout + 8 * i, A[i]);
+}
+
+#undef KXOR
+#undef KROL
+#undef KCHI
+#undef KRC
+
+#ifdef USE_KECCAK_X86_SIMD
+
+//
+// AVX2 kernel: four headers per call, one per 64-bit vector lane.
+//
+#define KXOR(a, b) _mm256_xor_si256((a), (b))
+#define KROL(a, n) _mm256_or_si256(_mm256_slli_epi64((a), (n)), _mm256_srli_epi64((a), 64 - (n)))
+#define KCHI(a, b, c) _mm256_xor_si256((a), _mm256_andnot_si256((b), (c)))
+#define KRC(i) _mm256_set1_epi64x((long long)pKeccakRoundConstants[i])
+
+__attribute__((target("avx2")))
+static void KeccakLanes4(const uint64* const* pplanes, uint256* phashes)
+{
+    __m256i A[25], B[25];
+    __m256i C0, C1, C2, C3, C4, D0, D1, D2, D3, D4;
+    for (unsigned int i = 0; i < HEADER_HASH_LANES; i++)
+        A[i] = _mm256_set_epi64x((long long)pplanes[3][i], (long long)pplanes[2][i],
+                                 (long long)pplanes[1][i], (long long)pplanes[0][i]);
+    for (unsigned int i = HEADER_HASH_LANES; i < 25; i++)
+        A[i] = _mm256_setzero_si256();
+    KECCAK_F1600();
+    uint64 out[4][4];
+    for (int i = 0; i < 4; i++)
+        _mm256_storeu_si256((__m256i*)out[i], A[i]);
+    for (int j = 0; j < 4; j++)
+    {
+        unsigned char* pout = (unsigned char*)&phashes[j];
+        for (int i = 0; i < 4; i++)
+            WriteLE64(pout + 8 * i, out[i][j]);
+    }
+}
+
+#undef KXOR
+#undef KROL
+#undef KCHI
+#undef KRC
+
+//
+// AVX-512 kernel: eight headers per call.
+//
+#define KXOR(a, b) _mm512_xor_si512((a), (b))
+#define KROL(a, n) _mm512_rol_epi64((a), (n))
+#define KCHI(a, b, c) _mm512_ternarylogic_epi64((a), (b), (c), 0xD2)
+#define KRC(i) _mm512_set1_epi64((long long)pKeccakRoundConstants[i])
+
+__attribute__((target("avx512f")))
+static void KeccakLanes8(const uint64* const* pplanes, uint256* phashes)
+{
+    __m512i A[25], B[25];
+    __m512i C0, C1, C2, C3, C4, D0, D1, D2, D3, D4;
+    for (unsigned int i = 0; i < HEADER_HASH_LANES; i++)
+        A[i] = _mm512_set_epi64((long long)pplanes[7][i], (long long)pplanes[6][i],
+                                (long long)pplanes[5][i], (long long)pplanes[4][i],
+                                (long long)pplanes[3][i], (long long)pplanes[2][i],
+                                (long long)pplanes[1][i], (long long)pplanes[0][i]);
+    for (unsigned int i = HEADER_HASH_LANES; i < 25; i++)
+        A[i] = _mm512_setzero_si512();
+    KECCAK_F1600();
+    uint64 out[4][8];
+    for (int i = 0; i < 4; i++)
+        _mm512_storeu_si512((void*)out[i], A[i]);
+    for (int j = 0; j < 8; j++)
+    {
+        unsigned char* pout = (unsigned char*)&phashes[j];
+        for (int i = 0; i < 4; i++)
+            WriteLE64(pout + 8 * i, out[i][j]);
+    }
+}
+
+#undef KXOR
+#undef KROL
+#undef KCHI
+#undef KRC
+
+#endif // USE_KECCAK_X86_SIMD
+
+#undef KECCAK_ROUND
+#undef KECCAK_F1600
+
+//
+// Run-time dispatch
+//
+typedef void (*KeccakLanesFunc)(const uint64* const* pplanes, uint256* phashes);
+
+struct CKeccakKernel
+{
+    int nLanes;
+    KeccakLanesFunc pfn;
+};
+
+static CKeccakKernel keccakKernel = { 1, KeccakLanes1 };
+static boost::once_flag keccakKernelInitFlag = BOOST_ONCE_INIT;
+
+static void SelectKeccakKernel()
+{
+#ifdef USE_KECCAK_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        keccakKernel.nLanes = 8;
+        keccakKernel.pfn = KeccakLanes8;
+    } else if (__builtin_cpu_supports("avx2")) {
+        keccakKernel.nLanes = 4;
+        keccakKernel.pfn = KeccakLanes4;
+    }
+#endif
+}
+
+// Both fields are set together before any thread gets past call_once
+static const CKeccakKernel& GetKeccakKernel()
+{
+    boost::call_once(&SelectKeccakKernel, keccakKernelInitFlag);
+    return keccakKernel;
+}
+
+int GetHeaderHashLanes()
+{
+    return GetKeccakKernel().nLanes;
+}
+
+CHeaderHasher::CHeaderHasher(const CBlockHeader& header)
+{
+    HeaderToLanes(header, lanes);
+    lanes[HEADER_HASH_NONCE_LANE] = NonceLane(lanes[HEADER_HASH_NONCE_LANE], 0);
+}
+
+void CHeaderHasher::SetTime(unsigned int nTime, unsigned int nBits)
+{
+    // nTime is the high half of lane 8 (bytes 68..71), nBits the low half of lane 9
+    lanes[8] = (lanes[8] & 0xFFFFFFFFULL) | ((uint64)nTime << 32);
+    lanes[HEADER_HASH_NONCE_LANE] = nBits;
+}
+
+void CHeaderHasher::GetLaneBytes(unsigned char* p) const
+{
+    for (unsigned int i = 0; i < HEADER_HASH_LANES; i++)
+        WriteLE64(p + 8 * i, lanes[i]);
+}
+
+uint256 CHeaderHasher::Hash(unsigned int nNonce) const
+{
+    uint64 input[HEADER_HASH_LANES];
+    memcpy(input, lanes, sizeof(input));
+    input[HEADER_HASH_NONCE_LANE] = NonceLane(input[HEADER_HASH_NONCE_LANE], nNonce);
+    const uint64* pinput = input;
+    uint256 hash;
+    KeccakLanes1(&pinput, &hash);
+    return hash;
+}
+
+void CHeaderHasher::HashNonces(unsigned int nNonceBegin, unsigned int nCount, uint256* phashes) const
+{
+    const CKeccakKernel& kernel = GetKeccakKernel();
+    const unsigned int nLanes = kernel.nLanes;
+    uint64 input[8][HEADER_HASH_LANES];
+    const uint64* pplanes[8];
+    for (unsigned int j = 0; j < nLanes; j++)
+    {
+        memcpy(input[j], lanes, sizeof(lanes));
+        pplanes[j] = input[j];
+    }
+
+    unsigned int i = 0;
+    for (; i + nLanes <= nCount; i += nLanes)
+    {
+        for (unsigned int j = 0; j < nLanes; j++)
+            input[j][HEADER_HASH_NONCE_LANE] = NonceLane(lanes[HEADER_HASH_NONCE_LANE], nNonceBegin + i + j);
+        kernel.pfn(pplanes, &phashes[i]);
+    }
+    for (; i < nCount; i++)
+        phashes[i] = Hash(nNonceBegin + i);
+}
+
+void HashHeaders(const CBlockHeader* pheaders, size_t n, uint256* phashes)
+{
+    const CKeccakKernel& kernel = GetKeccakKernel();
+    const size_t nLanes = kernel.nLanes;
+    uint64 input[8][HEADER_HASH_LANES];
+    const uint64* pplanes[8];
+    for (size_t j = 0; j < nLanes; j++)
+        pplanes[j] = input[j];
+
+    size_t i = 0;
+    for (; i + nLanes <= n; i += nLanes)
+    {
+        for (size_t j = 0; j < nLanes; j++)
+            HeaderToLanes(pheaders[i + j], input[j]);
+        kernel.pfn(pplanes, &phashes[i]);
+    }
+    for (; i < n; i++)
+    {
+        HeaderToLanes(pheaders[i], input[0]);
+        KeccakLanes1(pplanes, &phashes[i]);
+    }
+}
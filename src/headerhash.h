@@ -0,0 +1,63 @@
+// Copyright (c) 2014 The MaxCoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_HEADERHASH_H
+#define BITCOIN_HEADERHASH_H
+
+#include "uint256.h"
+
+#include <stddef.h>
+
+class CBlockHeader;
+
+/** Size of a serialized block header, the input of the proof-of-work hash */
+static const unsigned int HEADER_HASH_INPUT_SIZE = 80;
+/** Number of 64-bit Keccak lanes absorbed for one header (the Keccak-256 rate) */
+static const unsigned int HEADER_HASH_LANES = 17;
+/** Lane holding nBits (low half) and nNonce (high half) */
+static const unsigned int HEADER_HASH_NONCE_LANE = 9;
+/** Byte offset of the little-endian nNonce within the absorbed input */
+static const unsigned int HEADER_HASH_NONCE_OFFSET = HEADER_HASH_NONCE_LANE * 8 + 4;
+
+/** Keccak-256 of block headers, as computed by CBlockHeader::GetHash.
+ *
+ * An 80-byte header is smaller than the Keccak-256 rate, so it is hashed
+ * by one Keccak-f[1600] permutation of the padded input lanes.  The lanes
+ * that do not depend on the nonce are prepared once; hashing a nonce only
+ * patches HEADER_HASH_NONCE_LANE and runs the permutation.  Ranges of
+ * nonces are hashed 8 or 4 at a time with AVX-512 or AVX2 when the CPU
+ * supports them (checked at run time), one at a time otherwise.
+ */
+class CHeaderHasher
+{
+private:
+    uint64 lanes[HEADER_HASH_LANES];
+
+public:
+    CHeaderHasher(const CBlockHeader& header);
+
+    /** Replace nTime (and nBits) after CBlockHeader::UpdateTime */
+    void SetTime(unsigned int nTime, unsigned int nBits);
+
+    /** Hash of the header with the given nonce */
+    uint256 Hash(unsigned int nNonce) const;
+
+    /** Hash nCount consecutive nonces starting at nNonceBegin into phashes */
+    void HashNonces(unsigned int nNonceBegin, unsigned int nCount, uint256* phashes) const;
+
+    /** The padded input lanes, little-endian, with the nonce set to zero */
+    const uint64* GetLanes() const { return lanes; }
+
+    /** The padded input as the HEADER_HASH_LANES * 8 bytes a Keccak sponge
+     *  absorbs; external miners XOR these into a zero state, write the nonce
+     *  at HEADER_HASH_NONCE_OFFSET and run a single permutation */
+    void GetLaneBytes(unsigned char* p) const;
+};
+
+/** Hash n block headers into phashes, several headers at a time when possible */
+void HashHeaders(const CBlockHeader* pheaders, size_t n, uint256* phashes);
+
+/** Number of headers the Keccak kernel hashes in parallel on this CPU (1, 4 or 8) */
+int GetHeaderHashLanes();
+
+#endif
@@ -5,20 +5,30 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <map>
 
+#include <openssl/rand.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/tss.hpp>
+
 #include "key.h"
+#include "util.h"
 #include "schnorr.h"
+#include "cryptopp/eprecomp.h"
 
 using namespace CryptoPP;
 
-Integer CKey::HashPointMessage(const ECPPoint& R,
-    const byte* message, int mlen)
+static Integer HashPointMessage(const ECP& ec, const ECPPoint& R,
+    const byte* message, int mlen, bool fCompressed = false)
 {
     const int digestsize = 256/8;
     SHA3 sha(digestsize);
 
     int len = ec.EncodedPointSize();
     byte *buffer = new byte[len];
-    ec.EncodePoint(buffer, R, fCompressedPubKey);
+    ec.EncodePoint(buffer, R, fCompressed);
     sha.Update(buffer, len);
     delete[] buffer;
 
@@ -32,6 +42,272 @@ Integer CKey::HashPointMessage(const ECPPoint& R,
     return ans;
 }
 
+Integer CKey::HashPointMessage(const ECPPoint& R,
+    const byte* message, int mlen)
+{
+    return ::HashPointMessage(ec, R, message, mlen, fCompressedPubKey);
+}
+
+//
+// Group context shared by every CKey and CPubKey.
+//
+// The secp256r1 parameters and a fixed-base precomputation table for G are
+// built once per process; the table is only read afterwards.  CryptoPP's ECP
+// and ModularArithmetic keep mutable scratch values, so each thread gets its
+// own group objects (plain and Montgomery form) built from those parameters.
+//
+typedef DL_FixedBasePrecomputationImpl<ECPPoint> CECPPrecomputation;
+
+// Number of precomputed multiples kept per fixed base
+static const unsigned int SCHNORR_PRECOMPUTATION_STORAGE = 16;
+// Verifications of a public key before it gets a table of its own
+static const unsigned int SCHNORR_PUBKEY_TABLE_MIN_USES = 3;
+// Maximum number of public keys with a table (roughly 2kB each)
+static const unsigned int SCHNORR_PUBKEY_TABLE_MAX = 1024;
+// The table cache is split by a seeded hash of the public key, so that
+// verifying threads rarely wait on each other
+static const unsigned int SCHNORR_PUBKEY_CACHE_SHARDS = 16;
+// Use counters per shard; keys that share a counter take turns with it
+static const unsigned int SCHNORR_PUBKEY_USE_SLOTS = 1024;
+// Tables are built at most once per interval on average, in bursts of up
+// to SCHNORR_PUBKEY_TABLE_BUILD_BURST
+static const int64 SCHNORR_PUBKEY_TABLE_BUILD_INTERVAL = 100; // milliseconds
+static const int64 SCHNORR_PUBKEY_TABLE_BUILD_BURST = 16;
+
+class CSchnorrThreadContext
+{
+public:
+    ECP ec;                         // affine coordinates, for encoding and decoding
+    EcPrecomputation<ECP> group;    // Montgomery representation, for arithmetic
+    ECPPoint Gmr;                   // G in Montgomery representation
+
+    CSchnorrThreadContext(const Integer& p, const Integer& a, const Integer& b, const ECPPoint& G) :
+        ec(p, a, b)
+    {
+        group.SetCurve(ec);
+        Gmr = group.ConvertIn(G);
+    }
+};
+
+class CSchnorrGroup
+{
+public:
+    Integer p, a, b, q;
+    ECPPoint G;
+    CECPPrecomputation precompG;
+
+    CSchnorrGroup()
+    {
+        p = Integer("0xFFFFFFFF00000001000000000000000000000000FFFFFFFFFFFFFFFFFFFFFFFF");
+        a = Integer("-3");
+        b = Integer("0x5AC635D8AA3A93E7B3EBBD55769886BC651D06B0CC53B0F63BCE3C3E27D2604B");
+        q = Integer("0xFFFFFFFF00000000FFFFFFFFFFFFFFFFBCE6FAADA7179E84F3B9CAC2FC632551");
+        G = ECPPoint(Integer("0x6B17D1F2E12C4247F8BCE6E563A440F277037D812DEB33A0F4A13945D898C296"),
+                     Integer("0x4FE342E2FE1A7F9B8EE7EB4A7C0F9E162BCE33576B315ECECBB6406837BF51F5"));
+
+        CSchnorrThreadContext ctx(p, a, b, G);
+        precompG.SetBase(ctx.group, G);
+        precompG.Precompute(ctx.group, 256, SCHNORR_PRECOMPUTATION_STORAGE);
+    }
+};
+
+static const CSchnorrGroup& GetSchnorrGroup()
+{
+    static CSchnorrGroup group;
+    return group;
+}
+
+static boost::thread_specific_ptr<CSchnorrThreadContext> schnorrContext;
+
+static CSchnorrThreadContext& GetSchnorrContext()
+{
+    CSchnorrThreadContext* pctx = schnorrContext.get();
+    if (pctx == NULL)
+    {
+        const CSchnorrGroup& group = GetSchnorrGroup();
+        pctx = new CSchnorrThreadContext(group.p, group.a, group.b, group.G);
+        schnorrContext.reset(pctx);
+    }
+    return *pctx;
+}
+
+// k*G through the fixed-base table
+static ECPPoint MultiplyGenerator(const Integer& k)
+{
+    return GetSchnorrGroup().precompG.Exponentiate(GetSchnorrContext().group, k);
+}
+
+/** Precomputation tables for public keys that are verified repeatedly,
+ *  such as pool payout keys.  A key gets a table once it has been seen
+ *  SCHNORR_PUBKEY_TABLE_MIN_USES times, if the build rate allows it.
+ *  Lookups of keys with a table only take a shared lock; counting uses
+ *  takes a short exclusive one on a fixed-size array, never allocating.
+ */
+class CPubKeyPrecomputationCache
+{
+private:
+    typedef std::vector<unsigned char> key_type;
+    typedef boost::shared_ptr<const CECPPrecomputation> table_type;
+
+    struct CUseCounter
+    {
+        unsigned int nTag;
+        unsigned int nUses;
+    };
+
+    struct CShard
+    {
+        boost::shared_mutex csTables;
+        std::map<key_type, table_type> mapTables;
+        boost::mutex csUses;
+        CUseCounter uses[SCHNORR_PUBKEY_USE_SLOTS];
+    };
+
+    CShard shards[SCHNORR_PUBKEY_CACHE_SHARDS];
+    unsigned int nSeedShard;
+    unsigned int nSeedTag;
+
+    boost::mutex csBuild;
+    int64 nBuildTime; // when the next build is due if builds run at the full rate
+
+    // Whether the build rate leaves room for another table now
+    bool AllowBuild()
+    {
+        int64 nNow = GetTimeMillis();
+        boost::unique_lock<boost::mutex> lock(csBuild);
+        if (nBuildTime - nNow > SCHNORR_PUBKEY_TABLE_BUILD_INTERVAL * (SCHNORR_PUBKEY_TABLE_BUILD_BURST - 1))
+            return false;
+        nBuildTime = std::max(nBuildTime, nNow) + SCHNORR_PUBKEY_TABLE_BUILD_INTERVAL;
+        return true;
+    }
+
+public:
+    CPubKeyPrecomputationCache() : nBuildTime(0)
+    {
+        // Seeded so that peers cannot aim keys at one shard or counter
+        RAND_bytes((unsigned char*)&nSeedShard, sizeof(nSeedShard));
+        RAND_bytes((unsigned char*)&nSeedTag, sizeof(nSeedTag));
+        for (unsigned int i = 0; i < SCHNORR_PUBKEY_CACHE_SHARDS; i++)
+            memset(shards[i].uses, 0, sizeof(shards[i].uses));
+    }
+
+    table_type Get(const key_type& vchPubKey, const ECPPoint& Q)
+    {
+        unsigned int nHash = MurmurHash3(nSeedShard, vchPubKey);
+        CShard& shard = shards[nHash % SCHNORR_PUBKEY_CACHE_SHARDS];
+        {
+            boost::shared_lock<boost::shared_mutex> lock(shard.csTables);
+            std::map<key_type, table_type>::const_iterator mi = shard.mapTables.find(vchPubKey);
+            if (mi != shard.mapTables.end())
+                return mi->second;
+        }
+
+        {
+            // Keys seen only once or twice are the common case; a key that
+            // finds its counter taken starts it over.
+            unsigned int nTag = MurmurHash3(nSeedTag, vchPubKey) | 1;
+            boost::unique_lock<boost::mutex> lock(shard.csUses);
+            CUseCounter& counter = shard.uses[(nHash / SCHNORR_PUBKEY_CACHE_SHARDS) % SCHNORR_PUBKEY_USE_SLOTS];
+            if (counter.nTag != nTag)
+            {
+                counter.nTag = nTag;
+                counter.nUses = 0;
+            }
+            if (++counter.nUses < SCHNORR_PUBKEY_TABLE_MIN_USES)
+                return table_type();
+            counter.nUses = 0;
+        }
+        if (!AllowBuild())
+            return table_type();
+
+        // Building a table costs about one scalar multiplication; do it
+        // outside the lock.
+        const EcPrecomputation<ECP>& group = GetSchnorrContext().group;
+        CECPPrecomputation* ptable = new CECPPrecomputation();
+        ptable->SetBase(group, Q);
+        ptable->Precompute(group, 256, SCHNORR_PRECOMPUTATION_STORAGE);
+        table_type table(ptable);
+
+        boost::unique_lock<boost::shared_mutex> lock(shard.csTables);
+        if (shard.mapTables.size() >= SCHNORR_PUBKEY_TABLE_MAX / SCHNORR_PUBKEY_CACHE_SHARDS)
+        {
+            // Public keys are uniformly distributed, so the neighbour of
+            // the new key is as good as a random victim.
+            std::map<key_type, table_type>::iterator it = shard.mapTables.lower_bound(vchPubKey);
+            if (it == shard.mapTables.end())
+                it = shard.mapTables.begin();
+            shard.mapTables.erase(it);
+        }
+        shard.mapTables[vchPubKey] = table;
+        return table;
+    }
+};
+
+static CPubKeyPrecomputationCache pubKeyPrecomputationCache;
+
+// Check the signature (e, s) of hash against public key Q: with R = s*G + e*Q
+// the signature is valid if e == H(R || hash) mod q.  If the encoded public
+// key is given, a cached table for Q is used when there is one.
+static bool SchnorrVerify(const ECPPoint& Q, const std::vector<unsigned char>* pvchPubKey,
+    const uint256& hash, const std::vector<unsigned char>& vchSig)
+{
+    if (vchSig.size() != (SCHNORR_SIG_SIZE * 2))
+        return false;
+
+    Integer sigE, sigS;
+    sigE.Decode(&vchSig[0], SCHNORR_SIG_SIZE);
+    sigS.Decode(&vchSig[SCHNORR_SIG_SIZE], SCHNORR_SIG_SIZE);
+
+    const CSchnorrGroup& params = GetSchnorrGroup();
+    CSchnorrThreadContext& ctx = GetSchnorrContext();
+
+    boost::shared_ptr<const CECPPrecomputation> precompQ;
+    if (pvchPubKey != NULL)
+        precompQ = pubKeyPrecomputationCache.Get(*pvchPubKey, Q);
+
+    ECPPoint R;
+    if (precompQ)
+        R = params.precompG.CascadeExponentiate(ctx.group, sigS, *precompQ, sigE);
+    else
+        R = ctx.group.ConvertOut(ctx.group.GetGroup().CascadeScalarMultiply(ctx.Gmr, sigS, ctx.group.ConvertIn(Q), sigE));
+
+    Integer sigEd = HashPointMessage(ctx.ec, R, hash.begin(), sizeof(hash)) % params.q;
+    return (sigE == sigEd);
+}
+
+static bool DecodePubKey(const std::vector<unsigned char>& vchPubKey, ECPPoint& Q)
+{
+    if (vchPubKey.empty())
+        return false;
+    return GetSchnorrContext().ec.DecodePoint(Q, &vchPubKey[0], vchPubKey.size());
+}
+
+bool CPubKey::IsFullyValid() const
+{
+    ECPPoint Q;
+    return DecodePubKey(vchPubKey, Q);
+}
+
+bool CPubKey::Decompress()
+{
+    ECPPoint Q;
+    if (!DecodePubKey(vchPubKey, Q))
+        return false;
+    const ECP& ec = GetSchnorrContext().ec;
+    std::vector<unsigned char> vchUncompressed(ec.EncodedPointSize(false));
+    ec.EncodePoint(&vchUncompressed[0], Q, false);
+    vchPubKey.swap(vchUncompressed);
+    return true;
+}
+
+bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const
+{
+    ECPPoint Q;
+    if (!DecodePubKey(vchPubKey, Q))
+        return false;
+    return SchnorrVerify(Q, &vchPubKey, hash, vchSig);
+}
+
 void CKey::SetCompressedPubKey(bool fCompressed)
 {
     //fCompressedPubKey = fCompressed;
@@ -43,20 +319,11 @@ void CKey::LoadCurve()
     secretKeySet = false;
     publicKeySet = false;
 
-    // Load in curve secp256r1
-    Integer p, a, b, Gx, Gy;
-
-    // Create the group
-    p = Integer("0xFFFFFFFF00000001000000000000000000000000FFFFFFFFFFFFFFFFFFFFFFFF");
-    a = Integer("-3");
-    b = Integer("0x5AC635D8AA3A93E7B3EBBD55769886BC651D06B0CC53B0F63BCE3C3E27D2604B");
-    q = Integer("0xFFFFFFFF00000000FFFFFFFFFFFFFFFFBCE6FAADA7179E84F3B9CAC2FC632551");
-    Gx = Integer("0x6B17D1F2E12C4247F8BCE6E563A440F277037D812DEB33A0F4A13945D898C296");
-    Gy = Integer("0x4FE342E2FE1A7F9B8EE7EB4A7C0F9E162BCE33576B315ECECBB6406837BF51F5");
-
-    // Store the curve and the generator
-    ec = ECP(p, a, b);
-    G = ECPPoint(Gx, Gy);
+    // Copy the process-wide curve secp256r1 and its generator
+    const CSchnorrGroup& group = GetSchnorrGroup();
+    ec = ECP(group.p, group.a, group.b);
+    G = group.G;
+    q = group.q;
 }
 
 void CKey::Reset()
@@ -115,7 +382,7 @@ bool CKey::GeneratePublicKey()
 {
     if (!secretKeySet)
         return false;
-    Q = ec.ScalarMultiply(G, secretKey);
+    Q = MultiplyGenerator(secretKey);
     publicKeySet = true;
     return true;
 }
@@ -193,7 +460,7 @@ bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
     Integer sigE, sigS;
 
     k = Integer(rng, 256) % q;
-    R = ec.ScalarMultiply(G, k);
+    R = MultiplyGenerator(k);
 
     // encode hash as byte[]
     std::vector<unsigned char> vchHash = hash.toVch();
@@ -213,28 +480,7 @@ bool CKey::Sign(uint256 hash, std::vector<unsigned char>& vchSig)
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
 {
-    // decode the vchSig
-    Integer sigE, sigS;
-    if (vchSig.size() != (SCHNORR_SIG_SIZE * 2))
-        return false;
-
-    // extract bytes
-    std::vector<unsigned char> sigEVec(&vchSig[0], &vchSig[SCHNORR_SIG_SIZE]);
-    std::vector<unsigned char> sigSVec(&vchSig[SCHNORR_SIG_SIZE], &vchSig[1 + SCHNORR_SIG_SIZE * 2]);
-
-    // vectors -> Integers
-    sigE.Decode(&sigEVec[0], SCHNORR_SIG_SIZE);
-    sigS.Decode(&sigSVec[0], SCHNORR_SIG_SIZE);
-
-    // verify the hash
-    ECPPoint R;
-    R = ec.CascadeScalarMultiply(G, sigS, Q, sigE);
-
-    // encode hash as byte[]
-    std::vector<unsigned char> vchHash = hash.toVch();
-    Integer sigEd = HashPointMessage(R, &vchHash[0], sizeof(hash)) % q;
-
-    return (sigE == sigEd);
+    return SchnorrVerify(Q, NULL, hash, vchSig);
 }
 
 bool CKey::IsValid()
@@ -247,4 +493,19 @@ bool CKey::IsValid()
     CKey key2;
     key2.SetSecret(secret, fCompr);
     return GetPubKey() == key2.GetPubKey();
-}
\ No newline at end of file
+}
+
+bool CKey::CheckSecret(const CSecret& vchSecret, const CPubKey& vchPubKey)
+{
+    if (vchSecret.size() != SCHNORR_SECRET_KEY_SIZE)
+        return false;
+    Integer k;
+    k.Decode(&vchSecret[0], SCHNORR_SECRET_KEY_SIZE);
+    ECPPoint Q = MultiplyGenerator(k);
+
+    // Public keys are always encoded uncompressed, see SetCompressedPubKey
+    const ECP& ec = GetSchnorrContext().ec;
+    std::vector<unsigned char> vchEncoded(ec.EncodedPointSize(false));
+    ec.EncodePoint(&vchEncoded[0], Q, false);
+    return vchEncoded == vchPubKey.vchPubKey;
+}
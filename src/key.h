@@ -97,6 +97,16 @@ public:
     std::vector<unsigned char> Raw() const {
         return vchPubKey;
     }
+
+    // Check that the encoding decodes to a point on secp256r1.
+    bool IsFullyValid() const;
+
+    // Expand a compressed public key into its 65-byte form.
+    bool Decompress();
+
+    // Verify a Schnorr signature (e, s) against this public key.
+    // Needs no CKey: the group is shared process-wide and the call is thread-safe.
+    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 };
 
 
@@ -159,6 +169,10 @@ public:
     bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig);
 
     bool IsValid();
+
+    // Check that vchSecret is the secret of vchPubKey.  Costs one fixed-base
+    // multiplication, needs no CKey and is thread-safe.
+    static bool CheckSecret(const CSecret& vchSecret, const CPubKey& vchPubKey);
 };
 
 #endif
\ No newline at end of file
@@ -16,13 +16,34 @@ bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
     return true;
 }
 
+void CBasicKeyStore::IndexPubKey(const CPubKey& vchPubKey)
+{
+    CScript scriptPubKey;
+    scriptPubKey << vchPubKey << OP_CHECKSIG;
+    setScriptPubKeys.insert(scriptPubKey);
+    scriptPubKey.SetDestination(vchPubKey.GetID());
+    setScriptPubKeys.insert(scriptPubKey);
+}
+
 bool CBasicKeyStore::AddKey(const CKey& key)
 {
     bool fCompressed = false;
     CSecret secret = key.GetSecret(fCompressed);
+    CPubKey vchPubKey = key.GetPubKey();
     {
         LOCK(cs_KeyStore);
-        mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
+        mapKeys[vchPubKey.GetID()] = make_pair(secret, fCompressed);
+        IndexPubKey(vchPubKey);
+    }
+    return true;
+}
+
+bool CBasicKeyStore::AddKeyPubKey(const CSecret& vchSecret, const CPubKey& vchPubKey)
+{
+    {
+        LOCK(cs_KeyStore);
+        mapKeys[vchPubKey.GetID()] = make_pair(vchSecret, vchPubKey.IsCompressed());
+        IndexPubKey(vchPubKey);
     }
     return true;
 }
@@ -32,6 +53,15 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
     {
         LOCK(cs_KeyStore);
         mapScripts[redeemScript.GetID()] = redeemScript;
+
+        // Scripts that only become ours with keys added later are found by
+        // IsMine through mapScripts
+        if (IsMine(*this, redeemScript))
+        {
+            CScript scriptPubKey;
+            scriptPubKey.SetDestination(redeemScript.GetID());
+            setScriptPubKeys.insert(scriptPubKey);
+        }
     }
     return true;
 }
@@ -47,6 +77,12 @@ bool CBasicKeyStore::HaveCScript(const CScriptID& hash) const
 }
 
 
+bool CBasicKeyStore::HaveScriptPubKey(const CScript& scriptPubKey) const
+{
+    LOCK(cs_KeyStore);
+    return setScriptPubKeys.count(scriptPubKey) > 0;
+}
+
 bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
 {
     {
@@ -105,10 +141,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
                 return false;
             if (vchSecret.size() != 32)
                 return false;
-            CKey key;
-            key.SetPubKey(vchPubKey);
-            key.SetSecret(vchSecret);
-            if (key.GetPubKey() == vchPubKey)
+            if (CKey::CheckSecret(vchSecret, vchPubKey))
                 break;
             return false;
         }
@@ -140,6 +173,26 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
     return true;
 }
 
+bool CCryptoKeyStore::AddKeyPubKey(const CSecret& vchSecret, const CPubKey& vchPubKey)
+{
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted())
+            return CBasicKeyStore::AddKeyPubKey(vchSecret, vchPubKey);
+
+        if (IsLocked())
+            return false;
+
+        std::vector<unsigned char> vchCryptedSecret;
+        if (!EncryptSecret(vMasterKey, vchSecret, vchPubKey.GetHash(), vchCryptedSecret))
+            return false;
+
+        if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            return false;
+    }
+    return true;
+}
+
 
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
@@ -149,6 +202,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        IndexPubKey(vchPubKey);
     }
     return true;
 }
@@ -8,7 +8,9 @@
 
 #include "crypter.h"
 #include "sync.h"
+#include <boost/functional/hash.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_set.hpp>
 
 class CScript;
 
@@ -35,6 +37,11 @@ public:
     virtual bool HaveCScript(const CScriptID &hash) const =0;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const =0;
 
+    // Check whether scriptPubKey is in the index of scripts paying to the store,
+    // which holds the pay-to-pubkey and pay-to-pubkey-hash forms of every key;
+    // see IsMine in script.cpp for the rest
+    virtual bool HaveScriptPubKey(const CScript& scriptPubKey) const =0;
+
     virtual bool GetSecret(const CKeyID &address, CSecret& vchSecret, bool &fCompressed) const
     {
         CKey key;
@@ -48,15 +55,30 @@ public:
 typedef std::map<CKeyID, std::pair<CSecret, bool> > KeyMap;
 typedef std::map<CScriptID, CScript > ScriptMap;
 
+struct CScriptPubKeyHasher
+{
+    size_t operator()(const std::vector<unsigned char>& script) const
+    {
+        return boost::hash_range(script.begin(), script.end());
+    }
+};
+typedef boost::unordered_set<std::vector<unsigned char>, CScriptPubKeyHasher> ScriptPubKeySet;
+
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
 {
 protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
+    ScriptPubKeySet setScriptPubKeys;
+
+    // Add the scripts paying to vchPubKey to setScriptPubKeys
+    void IndexPubKey(const CPubKey& vchPubKey);
 
 public:
     bool AddKey(const CKey& key);
+    // Add a secret whose public key is already known, without deriving it
+    bool AddKeyPubKey(const CSecret& vchSecret, const CPubKey& vchPubKey);
     bool HaveKey(const CKeyID &address) const
     {
         bool result;
@@ -96,6 +118,7 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    bool HaveScriptPubKey(const CScript& scriptPubKey) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
@@ -148,6 +171,7 @@ public:
 
     virtual bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddKey(const CKey& key);
+    bool AddKeyPubKey(const CSecret& vchSecret, const CPubKey& vchPubKey);
     bool HaveKey(const CKeyID &address) const
     {
         {
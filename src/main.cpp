@@ -17,6 +17,7 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "headerhash.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -36,11 +37,46 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+CChain chainActive;
+
+/** Storage for the CBlockIndex entries of mapBlockIndex.  Entries are only
+ *  released all at once, so they are carved out of large chunks instead of
+ *  being allocated one by one, which saves the per-allocation overhead on
+ *  millions of headers and keeps neighbouring heights close in memory. */
+class CBlockIndexArena
+{
+private:
+    enum { CHUNK_SIZE = 16384 };
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+};
+static CBlockIndexArena blockIndexArena;
 uint256 hashGenesisBlock("0x0000002d0f86558a6e737a3a351043ee73906fe077692dfaa3c9328aaca21964");
 static const unsigned int timeGenesisBlock = 1390822264;
 static const unsigned int nNonceGenesisBlock = 11548217;
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 24);
+static const arith_uint256 bnProofOfWorkLimit(~uint256(0) >> 24);
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
@@ -54,7 +90,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 10000;  // Override with -mintxfee
@@ -180,7 +216,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -191,43 +227,109 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsKeyHasher::CCoinsKeyHasher() {
+    static const uint256 salt = GetRandHash();
+    k0 = salt.Get64(0);
+    k1 = salt.Get64(1);
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), fModified(false), nModifiedUsage(0) { }
+
+void CCoinsViewCache::UpdateModifiedUsage() {
+    if (!fModified)
+        return;
+    fModified = false;
+    CCoinsMap::iterator it = cacheCoins.find(hashModified);
+    if (it != cacheCoins.end()) {
+        cachedCoinsUsage -= nModifiedUsage;
+        cachedCoinsUsage += it->second.DynamicMemoryUsage();
     }
-    return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    UpdateModifiedUsage();
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(txid).first;
+    tmp.swap(ret->second.coins);
+    // A pruned entry in the parent is as good as none at all
+    if (ret->second.coins.IsPruned())
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
+bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
+}
+
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    cachedCoinsUsage -= it->second.DynamicMemoryUsage();
+    it->second.SetDirty();
+    fModified = true;
+    hashModified = txid;
+    nModifiedUsage = it->second.DynamicMemoryUsage();
+    cachedCoinsUsage += nModifiedUsage;
+    return it->second.coins;
+}
+
+bool CCoinsViewCache::SpendCoins(const COutPoint &out, CTxInUndo &undo) {
+    CCoinsMap::iterator it = FetchCoins(out.hash);
+    if (it == cacheCoins.end())
+        return false;
+    CCoinsCacheEntry &entry = it->second;
+    cachedCoinsUsage -= entry.DynamicMemoryUsage();
+    bool fSpent = entry.coins.Spend(out, undo);
+    if (fSpent)
+        entry.SetSpent(out.n);
+    cachedCoinsUsage += entry.DynamicMemoryUsage();
+    return fSpent;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    return it->second.coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    UpdateModifiedUsage();
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(txid);
+    CCoinsCacheEntry &entry = ret.first->second;
+    if (!ret.second)
+        cachedCoinsUsage -= entry.DynamicMemoryUsage();
+    entry.coins = coins;
+    entry.SetDirty();
+    cachedCoinsUsage += entry.DynamicMemoryUsage();
+    return true;
+}
+
+bool CCoinsViewCache::SetNewCoins(const uint256 &txid, const CCoins &coins) {
+    UpdateModifiedUsage();
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(txid);
+    CCoinsCacheEntry &entry = ret.first->second;
+    if (!ret.second)
+        cachedCoinsUsage -= entry.DynamicMemoryUsage();
+    else if (!base->HaveCoins(txid))
+        // Nothing below us to keep, as long as this txid has not been used
+        // before; without BIP30 on every block that has to be checked
+        entry.flags = CCoinsCacheEntry::FRESH;
+    entry.coins = coins;
+    entry.SetDirty();
+    cachedCoinsUsage += entry.DynamicMemoryUsage();
     return true;
 }
 
@@ -246,17 +348,49 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    UpdateModifiedUsage();
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        const CCoinsCacheEntry &child = it->second;
+        if (!child.IsModified())
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->first);
+        if (itUs == cacheCoins.end()) {
+            // Created and spent in the child without ever reaching us
+            if ((child.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned())
+                continue;
+            CCoinsCacheEntry &entry = cacheCoins.insert(it->first).first->second;
+            entry.coins = child.coins;
+            entry.flags = child.flags;
+            entry.vSpent = child.vSpent;
+            cachedCoinsUsage += entry.DynamicMemoryUsage();
+        } else if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && child.coins.IsPruned()) {
+            // Our parent never saw it either, so forget it
+            cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
+            cacheCoins.erase(itUs);
+        } else {
+            CCoinsCacheEntry &entry = itUs->second;
+            cachedCoinsUsage -= entry.DynamicMemoryUsage();
+            entry.coins = child.coins;
+            if (child.flags & CCoinsCacheEntry::DIRTY)
+                entry.SetDirty();
+            else
+                BOOST_FOREACH(unsigned int n, child.vSpent)
+                    entry.SetSpent(n);
+            cachedCoinsUsage += entry.DynamicMemoryUsage();
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    UpdateModifiedUsage();
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -264,6 +398,11 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    UpdateModifiedUsage();
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -540,7 +679,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -564,7 +703,7 @@ bool CTransaction::CheckTransaction(CValidationState &state) const
     if (vout.empty())
         return state.DoS(10, error("CTransaction::CheckTransaction() : vout empty"));
     // Size limits
-    if (::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+    if (GetTxSize() > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CTransaction::CheckTransaction() : size limits failed"));
 
     // Check for negative or overflow output values
@@ -610,7 +749,7 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
     // Base fee is either nMinTxFee or nMinRelayTxFee
     int64 nBaseFee = (mode == GMF_RELAY) ? nMinRelayTxFee : nMinTxFee;
 
-    unsigned int nBytes = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nBytes = GetTxSize();
     unsigned int nNewBlockSize = nBlockSize + nBytes;
     int64 nMinFee = (1 + (int64)nBytes / 1000) * nBaseFee;
 
@@ -697,7 +836,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     }
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    const CTransaction* ptxOld = NULL;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -769,7 +908,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
         // reasonable number of ECDSA signature verifications.
 
         int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        unsigned int nSize = tx.GetTxSize();
 
         // Don't accept it if it can't get into a block
         int64 txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
@@ -843,14 +982,94 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
-        mapTx[hash] = tx;
+        CTransactionRef ptx(new CTransaction(tx));
+        // Fill the caches before the instance is shared with other threads
+        ptx->GetHash();
+
+        CTxMemPoolEntry& entry = mapTx[hash];
+        entry.ptx = ptx;
+        entry.nTxSize = ptx->GetTxSize();
+
+        // Link the transactions in the pool that this one spends, and add up
+        // the value of its inputs
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, *this);
+        CCoinsViewCache view(viewMemPool, true);
+        int64 nValueIn = 0;
+        bool fHaveInputs = true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(txin.prevout.hash);
+            if (mi != mapTx.end())
+            {
+                entry.setParents.insert(txin.prevout.hash);
+                (*mi).second.setChildren.insert(hash);
+                const CTransaction& txPrev = (*mi).second.GetTx();
+                if (txin.prevout.n < txPrev.vout.size())
+                    nValueIn += txPrev.vout[txin.prevout.n].nValue;
+                continue;
+            }
+            if (!view.HaveCoins(txin.prevout.hash))
+            {
+                fHaveInputs = false;
+                continue;
+            }
+            const CCoins &coins = view.AccessCoins(txin.prevout.hash);
+            if (!coins.IsAvailable(txin.prevout.n))
+            {
+                fHaveInputs = false;
+                continue;
+            }
+            nValueIn += coins.vout[txin.prevout.n].nValue;
+        }
+        UpdatePriority(entry);
+        entry.nFee = nValueIn - tx.GetValueOut();
+        entry.dFeePerKb = double(entry.nFee) / (double(entry.nTxSize) / 1000.0);
+        entry.nSigOps = tx.GetLegacySigOpCount();
+        if (fHaveInputs)
+            entry.nSigOps += tx.GetP2SHSigOpCount(view);
+
+        // Transactions already in the pool may spend this one when those of
+        // a disconnected block are put back
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashChild = (*it).second.ptx->GetHash();
+            entry.setChildren.insert(hashChild);
+            CTxMemPoolEntry& child = mapTx[hashChild];
+            child.setParents.insert(hash);
+            UpdatePriority(child);
+        }
+
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(ptx.get(), i);
+        setByFeeRate.insert(make_pair(entry.dFeePerKb, hash));
         nTransactionsUpdated++;
     }
     return true;
 }
 
+// Work out the priority of entry from its inputs in the chain, once instead
+// of for every block template; inputs from the pool count for nothing
+void CTxMemPool::UpdatePriority(CTxMemPoolEntry& entry)
+{
+    entry.nHeight = nBestHeight;
+    entry.nValueInChain = 0;
+    entry.dPriority = 0;
+    BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin)
+    {
+        if (mapTx.count(txin.prevout.hash) || !pcoinsTip->HaveCoins(txin.prevout.hash))
+            continue;
+        const CCoins &coins = pcoinsTip->AccessCoins(txin.prevout.hash);
+        if (!coins.IsAvailable(txin.prevout.n))
+            continue;
+        int64 nValue = coins.vout[txin.prevout.n].nValue;
+        entry.nValueInChain += nValue;
+        entry.dPriority += (double)nValue * (entry.nHeight - coins.nHeight + 1);
+    }
+    entry.dPriority /= entry.nTxSize;
+}
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -865,11 +1084,36 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                     remove(*it->second.ptx, true);
             }
         }
-        if (mapTx.count(hash))
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+        if (mi != mapTx.end())
         {
+            const CTxMemPoolEntry& entry = (*mi).second;
+            std::vector<uint256> vChildren(entry.setChildren.begin(), entry.setChildren.end());
+            BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+            {
+                std::map<uint256, CTxMemPoolEntry>::iterator mp = mapTx.find(hashParent);
+                if (mp != mapTx.end())
+                    (*mp).second.setChildren.erase(hash);
+            }
+            BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+            {
+                std::map<uint256, CTxMemPoolEntry>::iterator mc = mapTx.find(hashChild);
+                if (mc != mapTx.end())
+                    (*mc).second.setParents.erase(hash);
+            }
+            setByFeeRate.erase(make_pair(entry.dFeePerKb, hash));
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(mi);
+
+            // Once this transaction is in a block, what its children spend
+            // from it is in the chain and starts to age
+            BOOST_FOREACH(const uint256& hashChild, vChildren)
+            {
+                std::map<uint256, CTxMemPoolEntry>::iterator mc = mapTx.find(hashChild);
+                if (mc != mapTx.end())
+                    UpdatePriority((*mc).second);
+            }
             nTransactionsUpdated++;
         }
     }
@@ -896,6 +1140,7 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByFeeRate.clear();
     ++nTransactionsUpdated;
 }
 
@@ -905,7 +1150,7 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
@@ -918,7 +1163,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1047,22 +1292,77 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
+}
+
+CBlockIndex* FindBlockByTime(int64 nTime)
+{
+    // Block times can be two hours off and are not in order, so go by the
+    // latest time seen so far along the chain
+    int64 nTimeMax = 0;
+    for (int nHeight = 0; nHeight <= chainActive.Height(); nHeight++)
+    {
+        CBlockIndex* pindex = chainActive[nHeight];
+        nTimeMax = std::max(nTimeMax, pindex->GetBlockTime());
+        if (nTimeMax >= nTime - 2 * 60 * 60)
+            return pindex;
+    }
+    return NULL;
+}
+
+// Height of the skip pointer of a block at nHeight.  Any height is reached
+// from any descendant in O(log n) skips and single steps.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    // Clear the lowest set bit of nHeight, or for odd heights of nHeight-1
+    // twice, so skips from neighbouring heights land far apart
+    if (nHeight & 1) {
+        int n = nHeight - 1;
+        n &= n - 1;
+        n &= n - 1;
+        return n + 1;
+    }
+    return nHeight & (nHeight - 1);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightIn) {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        // Take the skip unless it overshoots, or the predecessor's skip
+        // gets closer to the target
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightIn ||
+             (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn)))) {
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
@@ -1124,7 +1424,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     if (fTestNet && nTime > nTargetSpacing*2)
         return bnProofOfWorkLimit.GetCompact();
 
-    CBigNum bnResult;
+    arith_uint256 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnProofOfWorkLimit)
     {
@@ -1175,9 +1475,7 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
     if ((pindexLast->nHeight+1) != nInterval)
         blockstogoback = nInterval;
 
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1189,10 +1487,10 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
         nActualTimespan = nTargetTimespan*4;
 
     // Retarget
-    CBigNum bnNew;
+    arith_uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespan;
+    bnNew *= (unsigned int)nActualTimespan;
+    bnNew /= (unsigned int)nTargetTimespan;
 
     if (bnNew > bnProofOfWorkLimit)
         bnNew = bnProofOfWorkLimit;
@@ -1200,7 +1498,10 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
     return bnNew.GetCompact();
 }
 
-unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
+// Reference gravity well on CBigNum, for chains whose nBits the fixed-width
+// version cannot hold; CheckProofOfWork keeps such nBits out of the block
+// index, so this is not reached in practice
+unsigned int static KimotoGravityWellBigNum(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
         /* current difficulty formula, megacoin - kimoto gravity well */
         const CBlockIndex *BlockLastSolved = pindexLast;
         const CBlockIndex *BlockReading = pindexLast;
@@ -1215,8 +1516,9 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
         double EventHorizonDeviation;
         double EventHorizonDeviationFast;
         double EventHorizonDeviationSlow;
+        CBigNum bnLimit(bnProofOfWorkLimit.getuint256());
         
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnProofOfWorkLimit.GetCompact(); }
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnLimit.GetCompact(); }
         
         for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
                 if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
@@ -1249,11 +1551,108 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
                 bnNew *= PastRateActualSeconds;
                 bnNew /= PastRateTargetSeconds;
         }
-    if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
+    if (bnNew > bnLimit) { bnNew = bnLimit; }
         
     return bnNew.GetCompact();
 }
 
+/** EventHorizonDeviation of the gravity well by PastBlocksMass, and its
+ *  inverse, computed once instead of with a pow() per step */
+class CKGWDeviationTable
+{
+public:
+    enum { SIZE = 1024 };
+    double vFast[SIZE];
+    double vSlow[SIZE];
+
+    static double Deviation(uint64 PastBlocksMass)
+    {
+        return 1 + (0.7084 * pow((double(PastBlocksMass)/double(28.2)), -1.228));
+    }
+
+    CKGWDeviationTable()
+    {
+        vFast[0] = vSlow[0] = 0;
+        for (int i = 1; i < SIZE; i++) {
+            vFast[i] = Deviation(i);
+            vSlow[i] = 1 / vFast[i];
+        }
+    }
+};
+static const CKGWDeviationTable kgwDeviation;
+
+// Same result as KimotoGravityWellBigNum, with the running average kept in
+// a fixed-width integer on the stack.  CBigNum division truncates toward
+// zero, so (target - average) / i is computed on the magnitude and its sign
+// applied afterwards.
+unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
+        const CBlockIndex *BlockLastSolved = pindexLast;
+        const CBlockIndex *BlockReading = pindexLast;
+        uint64 PastBlocksMass = 0;
+        int64 PastRateActualSeconds = 0;
+        int64 PastRateTargetSeconds = 0;
+        double PastRateAdjustmentRatio = double(1);
+        arith_uint256 PastDifficultyAverage;
+        arith_uint256 bnReading;
+        bool fNegative, fOverflow;
+
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnProofOfWorkLimit.GetCompact(); }
+
+        for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+                if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
+                PastBlocksMass++;
+
+                bnReading.SetCompact(BlockReading->nBits, &fNegative, &fOverflow);
+                if (fNegative || fOverflow)
+                        return KimotoGravityWellBigNum(pindexLast, pblock, TargetBlocksSpacingSeconds, PastBlocksMin, PastBlocksMax);
+                if (i == 1) { PastDifficultyAverage = bnReading; }
+                else if (bnReading >= PastDifficultyAverage) {
+                        bnReading -= PastDifficultyAverage;
+                        bnReading /= i;
+                        PastDifficultyAverage += bnReading;
+                }
+                else {
+                        arith_uint256 bnDelta(PastDifficultyAverage);
+                        bnDelta -= bnReading;
+                        bnDelta /= i;
+                        PastDifficultyAverage -= bnDelta;
+                }
+
+                PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
+                PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
+                PastRateAdjustmentRatio = double(1);
+                if (PastRateActualSeconds < 0) { PastRateActualSeconds = 0; }
+                if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+                PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+                }
+
+                if (PastBlocksMass >= PastBlocksMin) {
+                        double EventHorizonDeviationFast, EventHorizonDeviationSlow;
+                        if (PastBlocksMass < (uint64)CKGWDeviationTable::SIZE) {
+                                EventHorizonDeviationFast = kgwDeviation.vFast[PastBlocksMass];
+                                EventHorizonDeviationSlow = kgwDeviation.vSlow[PastBlocksMass];
+                        } else {
+                                EventHorizonDeviationFast = CKGWDeviationTable::Deviation(PastBlocksMass);
+                                EventHorizonDeviationSlow = 1 / EventHorizonDeviationFast;
+                        }
+                        if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { break; }
+                }
+                if (BlockReading->pprev == NULL) { break; }
+                BlockReading = BlockReading->pprev;
+        }
+
+        // Block times are 32-bit, and the target span is at most
+        // TargetBlocksSpacingSeconds * PastBlocksMax, so both fit MulDiv
+        arith_uint256 bnNew(PastDifficultyAverage);
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+                if (PastRateTargetSeconds > 0xffffffffLL || !bnNew.MulDiv(PastRateActualSeconds, PastRateTargetSeconds))
+                        bnNew = bnProofOfWorkLimit;
+        }
+    if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
+
+    return bnNew.GetCompact();
+}
+
 unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
         static const int64 BlocksTargetSpacing = 0.5 * 60; // 30 seconds
@@ -1262,8 +1661,15 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
         int64 PastSecondsMax = TimeDaySeconds * 0.14;
         uint64 PastBlocksMin = PastSecondsMin / BlocksTargetSpacing;
         uint64 PastBlocksMax = PastSecondsMax / BlocksTargetSpacing;
-        
-        return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+
+        // The result does not depend on pblock, so mining, getwork refreshes
+        // and AcceptBlock share one computation per parent block
+        if (pindexLast && pindexLast->nBitsNext)
+                return pindexLast->nBitsNext;
+        unsigned int nBits = KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+        if (pindexLast)
+                pindexLast->nBitsNext = nBits;
+        return nBits;
 }
 
 unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
@@ -1283,11 +1689,12 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
@@ -1423,7 +1830,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1460,15 +1867,17 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
     // mark inputs spent
     if (!IsCoinBase()) {
         BOOST_FOREACH(const CTxIn &txin, vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
             CTxInUndo undo;
-            assert(coins.Spend(txin.prevout, undo));
+            assert(inputs.SpendCoins(txin.prevout, undo));
             txundo.vprevout.push_back(undo);
         }
     }
 
-    // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    // add outputs; only a coinbase can repeat the txid of a transaction with unspent outputs
+    if (IsCoinBase())
+        assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    else
+        assert(inputs.SetNewCoins(txhash, CCoins(*this, nHeight)));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1484,7 +1893,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1524,7 +1933,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1560,7 +1969,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         if (fScriptChecks) {
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
                 CScriptCheck check(coins, *this, i, flags, 0);
@@ -1699,7 +2108,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(SCRIPT_CHECK_BATCH_SIZE);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
@@ -1744,7 +2153,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1753,7 +2162,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     int64 nBIP16SwitchTime = 1333238400;
     bool fStrictPayToScriptHash = (pindex->nTime >= nBIP16SwitchTime);
 
-    unsigned int flags = SCRIPT_VERIFY_NOCACHE |
+    // Only a block being connected for real can drop the cache entries it
+    // uses; a template check must leave them for that connect
+    unsigned int flags = (fJustCheck ? SCRIPT_VERIFY_NONE : SCRIPT_VERIFY_NOCACHE) |
                          (fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
 
     CBlockUndo blockundo;
@@ -1767,6 +2178,10 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(vtx.size());
+    // Script checks are collected across transactions and handed to the
+    // queue a batch at a time, so workers are woken once per batch rather
+    // than once per transaction.
+    std::vector<CScriptCheck> vChecks;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
@@ -1793,10 +2208,12 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
             nFees += tx.GetValueIn(view)-tx.GetValueOut();
 
-            std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            if (vChecks.size() >= SCRIPT_CHECK_BATCH_SIZE) {
+                control.Add(vChecks);
+                vChecks.clear();
+            }
         }
 
         CTxUndo txundo;
@@ -1807,6 +2224,8 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         vPos.push_back(std::make_pair(GetTxHash(i), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
+    control.Add(vChecks);
+    vChecks.clear();
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
         printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
@@ -1948,7 +2367,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1999,7 +2418,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = pindexNew->GetBlockHash();
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
+    chainActive.SetTip(pindexNew);
     nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
@@ -2047,15 +2466,16 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->nTx = vtx.size();
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
@@ -2274,7 +2694,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2363,7 +2783,7 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fCheckedBlock)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2373,10 +2793,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    if (!fCheckedBlock && !pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2385,9 +2805,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         {
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"));
         }
-        CBigNum bnNewBlock;
+        arith_uint256 bnNewBlock;
         bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        arith_uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
         if (bnNewBlock > bnRequired)
         {
@@ -2643,14 +3063,12 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -2676,6 +3094,7 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
+        pindex->BuildSkip();
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
@@ -2711,6 +3130,7 @@ bool static LoadBlockIndexDB()
     nBestChainWork = pindexBest->nChainWork;
 
     // set 'next' pointers in best chain
+    chainActive.SetTip(pindexBest);
     CBlockIndex *pindex = pindexBest;
     while(pindex != NULL && pindex->pprev != NULL) {
          CBlockIndex *pindexPrev = pindex->pprev;
@@ -2764,7 +3184,7 @@ bool VerifyDB() {
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() <= nCoinCacheUsage) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2801,6 +3221,8 @@ bool VerifyDB() {
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
+    chainActive.SetTip(NULL);
     setBlockIndexValid.clear();
     pindexGenesisBlock = NULL;
     nBestHeight = 0;
@@ -2851,6 +3273,7 @@ bool InitBlockIndex() {
         txNew.vin[0].scriptSig = CScript() << 486604799 << CBigNum(4) << vector<unsigned char>((const unsigned char*)pszTimestamp, (const unsigned char*)pszTimestamp + strlen(pszTimestamp));
         txNew.vout[0].nValue = nGenesisBlockRewardCoin;
         txNew.vout[0].scriptPubKey = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
+        txNew.InvalidateHash();
         CBlock block;
         block.vtx.push_back(txNew);
         block.hashPrevBlock = 0;
@@ -2875,7 +3298,7 @@ bool InitBlockIndex() {
 
             // This will figure out a valid hash and Nonce if you're
             // creating a different genesis block:
-            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+            uint256 hashTarget = arith_uint256().SetCompact(block.nBits).getuint256();
             //hashTarget = bnProofOfWorkLimit.getuint256();
 
             loop
@@ -2933,7 +3356,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2999,73 +3422,243 @@ void PrintBlockTree()
     }
 }
 
+// Blocks read ahead of the connect stage while importing a block file
+static const unsigned int IMPORT_QUEUE_BLOCKS = 32;
+
+/** Read-ahead pipeline used by LoadExternalBlockFile.
+ *
+ * A reader thread scans the file for the message start and block size and
+ * deserializes blocks, check threads run the context-free CBlock::CheckBlock
+ * on them in parallel, and the caller takes them back in file order through
+ * Next() to connect them.  At most IMPORT_QUEUE_BLOCKS blocks are in flight.
+ */
+class CBlockImporter
+{
+public:
+    struct CQueuedBlock
+    {
+        CBlock block;
+        uint64 nBlockPos;
+        bool fChecked; // CheckBlock has run on block
+        bool fValid;   // and it passed
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condChecker;
+    boost::condition_variable condNext;
+    boost::thread_group threads;
+
+    // Blocks read and not yet returned by Next(), in file order
+    std::deque<CQueuedBlock*> queue;
+    // Counters over the whole file: blocks read, handed to a check thread, returned by Next()
+    uint64 nRead, nCheckStarted, nReturned;
+    bool fReaderDone;
+    bool fQuit;
+    std::string strError;
+
+    FILE* fileIn;
+    uint64 nStartByte;
+
+    bool Push(CQueuedBlock* pqueued)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && queue.size() >= IMPORT_QUEUE_BLOCKS)
+                condReader.wait(lock);
+            if (fQuit)
+                return false;
+            queue.push_back(pqueued);
+            nRead++;
+        }
+        condChecker.notify_one();
+        return true;
+    }
+
+    void ThreadRead()
+    {
+        try {
+            CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            if (nStartByte)
+                blkdat.Seek(nStartByte); // (try to) skip already indexed part
+            uint64 nRewind = blkdat.GetPos();
+            while (blkdat.good() && !blkdat.eof() && !fQuit) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[4];
+                    blkdat.FindByte(pchMessageStart[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, pchMessageStart, 4))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (std::exception &e) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+                try {
+                    // read block
+                    uint64 nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    std::auto_ptr<CQueuedBlock> pqueued(new CQueuedBlock());
+                    blkdat >> pqueued->block;
+                    nRewind = blkdat.GetPos();
+
+                    if (nBlockPos >= nStartByte) {
+                        pqueued->nBlockPos = nBlockPos;
+                        pqueued->fChecked = pqueued->fValid = false;
+                        if (!Push(pqueued.get()))
+                            break;
+                        pqueued.release();
+                    }
+                } catch (std::exception &e) {
+                    printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+                }
+            }
+        } catch (std::runtime_error &e) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            strError = e.what();
+        }
+        fclose(fileIn);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fReaderDone = true;
+        }
+        condChecker.notify_all();
+        condNext.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        loop {
+            CQueuedBlock* pqueued;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nCheckStarted == nRead) {
+                    if (fReaderDone)
+                        return;
+                    condChecker.wait(lock);
+                }
+                if (fQuit)
+                    return;
+                // Next() only takes a block off the queue once it is checked
+                pqueued = queue[nCheckStarted - nReturned];
+                nCheckStarted++;
+            }
+
+            CValidationState state;
+            bool fValid = pqueued->block.CheckBlock(state);
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pqueued->fValid = fValid;
+                pqueued->fChecked = true;
+            }
+            condNext.notify_one();
+        }
+    }
+
+public:
+    CBlockImporter(FILE* fileInIn, uint64 nStartByteIn) : nRead(0), nCheckStarted(0), nReturned(0),
+        fReaderDone(false), fQuit(false), fileIn(fileInIn), nStartByte(nStartByteIn)
+    {
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+        for (int i = 0; i < std::max(nScriptCheckThreads, 1); i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+    }
+
+    ~CBlockImporter()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condReader.notify_all();
+        condChecker.notify_all();
+        threads.join_all();
+        BOOST_FOREACH(CQueuedBlock* pqueued, queue)
+            delete pqueued;
+    }
+
+    // Next block in file order once it has been checked, or NULL at the end
+    // of the file; the caller owns the returned block
+    CQueuedBlock* Next()
+    {
+        CQueuedBlock* pqueued = NULL;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty() ? !fReaderDone : !queue.front()->fChecked)
+                condNext.wait(lock);
+            if (queue.empty())
+                return NULL;
+            pqueued = queue.front();
+            queue.pop_front();
+            nReturned++;
+        }
+        condReader.notify_one();
+        return pqueued;
+    }
+
+    // Error that stopped the reader, if any; valid once Next() returned NULL
+    std::string GetError()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strError;
+    }
+};
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
-    try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64 nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
-        }
-        uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
+    uint64 nStartByte = 0;
+    if (dbp) {
+        // (try to) skip already indexed part
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
+            nStartByte = info.nSize;
+    }
+
+    std::string strError;
+    {
+        CBlockImporter importer(fileIn, nStartByte);
+        loop {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(pchMessageStart[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, pchMessageStart, 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
+            std::auto_ptr<CBlockImporter::CQueuedBlock> pqueued(importer.Next());
+            if (!pqueued.get()) {
+                strError = importer.GetError();
                 break;
             }
+
             try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
+                // process block; blocks that failed CheckBlock are passed
+                // through unchecked so ProcessBlock reports them as before
+                LOCK(cs_main);
+                if (dbp)
+                    dbp->nPos = pqueued->nBlockPos;
+                CValidationState state;
+                if (ProcessBlock(state, NULL, &pqueued->block, dbp, pqueued->fValid))
+                    nLoaded++;
+                if (state.IsError())
+                    break;
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
-        fclose(fileIn);
-    } catch(std::runtime_error &e) {
-        AbortNode(_("Error: system error: ") + e.what());
     }
+    if (!strError.empty())
+        AbortNode(_("Error: system error: ") + strError);
     if (nLoaded > 0)
         printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -3176,6 +3769,46 @@ bool static AlreadyHave(const CInv& inv)
 // a large 4-byte int at any alignment.
 unsigned char pchMessageStart[4] = { 0xf9, 0xbe, 0xbb, 0xd2 };
 
+// Queue the block stored at pos as a "block" message to pfrom.  The bytes
+// are read from the block file straight into the send buffer, instead of
+// deserializing the block and serializing it again.  Returns false, having
+// sent nothing, if the stored data is not the block with hash hashBlock.
+bool static PushRawBlock(CNode* pfrom, const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    // Blocks are stored as message start, size, then the serialized block
+    if (pos.IsNull() || pos.nPos < sizeof(unsigned int))
+        return false;
+    FILE* file = OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(unsigned int)), true);
+    if (!file)
+        return false;
+    unsigned int nSize = 0;
+    if (fread(&nSize, sizeof(nSize), 1, file) != 1 || nSize < HEADER_HASH_INPUT_SIZE || nSize > MAX_BLOCK_SIZE) {
+        fclose(file);
+        return false;
+    }
+
+    bool fSent = false;
+    pfrom->BeginMessage("block");
+    try {
+        CDataStream& ssSend = pfrom->ssSend;
+        unsigned int nStart = ssSend.size();
+        ssSend.resize(nStart + nSize);
+        char* pblock = &ssSend[nStart];
+        if (fread(pblock, 1, nSize, file) == nSize && HashKeccak(pblock, pblock + HEADER_HASH_INPUT_SIZE) == hashBlock) {
+            pfrom->EndMessage();
+            fSent = true;
+        } else {
+            pfrom->AbortMessage();
+        }
+    } catch (...) {
+        pfrom->AbortMessage();
+        fclose(file);
+        throw;
+    }
+    fclose(file);
+    return fSent;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3194,16 +3827,31 @@ void static ProcessGetData(CNode* pfrom)
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk.  Only the index lookup needs cs_main;
+                // index entries are never freed while running, so reading and
+                // sending the block is done without it.
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                }
+                if (pindex)
                 {
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        if (!PushRawBlock(pfrom, pindex->GetBlockPos(), inv.hash)) {
+                            block.ReadFromDisk(pindex);
+                            pfrom->PushMessage("block", block);
+                        }
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        block.ReadFromDisk(pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3217,8 +3865,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second));
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -3231,7 +3886,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3239,28 +3894,23 @@ void static ProcessGetData(CNode* pfrom)
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
-                bool pushed = false;
+                // Send transaction from relay memory or the memory pool;
+                // both share the instance, so only a reference is taken
+                // under the lock and it is serialized after
+                CTransactionRef ptx;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
+                    map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
+                    if (mi != mapRelay.end())
+                        ptx = (*mi).second;
                 }
-                if (!pushed && inv.type == MSG_TX) {
+                if (!ptx && inv.type == MSG_TX) {
                     LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
+                    ptx = mempool.get(inv.hash);
                 }
-                if (!pushed) {
+                if (ptx) {
+                    pfrom->PushMessage(inv.GetCommand(), *ptx);
+                } else {
                     vNotFound.push_back(inv);
                 }
             }
@@ -3601,7 +4251,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3632,7 +4282,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
@@ -3874,6 +4523,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that only read shared state, under the finer grained locks they
+// take themselves.  They are processed without cs_main, so message handler
+// threads can serve blocks and transactions to many peers at once.
+// "getaddr" is not one of them: it fills vAddrToSend and setAddrKnown,
+// which the address relay and SendMessages change under cs_main.
+static bool IsReadOnlyMessage(const string& strCommand)
+{
+    return strCommand == "getdata" || strCommand == "mempool" || strCommand == "ping";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3952,6 +4611,9 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (IsReadOnlyMessage(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4185,109 +4847,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 // BitcoinMiner
 //
 
-int static FormatHashBlocks(void* pbuffer, unsigned int len)
-{
-    unsigned char* pdata = (unsigned char*)pbuffer;
-    unsigned int blocks = 1 + ((len + 8) / 64);
-    unsigned char* pend = pdata + 64 * blocks;
-    memset(pdata + len, 0, 64 * blocks - len);
-    pdata[len] = 0x80;
-    unsigned int bits = len * 8;
-    pend[-1] = (bits >> 0) & 0xff;
-    pend[-2] = (bits >> 8) & 0xff;
-    pend[-3] = (bits >> 16) & 0xff;
-    pend[-4] = (bits >> 24) & 0xff;
-    return blocks;
-}
-
-static const unsigned int pSHA256InitState[8] =
-{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
-
-void SHA256Transform(void* pstate, void* pinput, const void* pinit)
-{
-    SHA256_CTX ctx;
-    unsigned char data[64];
-
-    SHA256_Init(&ctx);
-
-    for (int i = 0; i < 16; i++)
-        ((uint32_t*)data)[i] = ReverseBytes(((uint32_t*)pinput)[i]);
-
-    for (int i = 0; i < 8; i++)
-        ctx.h[i] = ((uint32_t*)pinit)[i];
-
-    SHA256_Update(&ctx, data, sizeof(data));
-    for (int i = 0; i < 8; i++)
-        ((uint32_t*)pstate)[i] = ctx.h[i];
-}
-
-//
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// It operates on big endian data.  Caller does the byte reversing.
-// All input buffers are 16-byte aligned.  nNonce is usually preserved
-// between calls, but periodically or if nNonce is 0xffff0000 or above,
-// the block is rebuilt and nNonce starts over at zero.
-//
-/*
-unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
-{
-    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
-    for (;;)
-    {
-        // Crypto++ SHA256
-        // Hash pdata using pmidstate as the starting state into
-        // pre-formatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
-            return nNonce;
-
-        // If nothing found after trying for a while, return -1
-        if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
-            return (unsigned int) -1;
-        }
-        if ((nNonce & 0xfff) == 0)
-            boost::this_thread::interruption_point();
-    }
-}
-*/
-
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().c_str());
-    }
-};
-
-
 uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTxMemPoolEntry*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -4310,6 +4874,15 @@ public:
     }
 };
 
+// Whether every transaction in the pool that entry spends is already in the block
+static bool HaveParentsInBlock(const CTxMemPoolEntry& entry, const set<uint256>& setInBlock)
+{
+    BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+        if (!setInBlock.count(hashParent))
+            return false;
+    return true;
+}
+
 CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
 {
     // Create new block
@@ -4327,6 +4900,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
     if (!reservekey.GetReservedKey(pubkey))
         return NULL;
     txNew.vout[0].scriptPubKey << pubkey << OP_CHECKSIG;
+    txNew.InvalidateHash();
 
     // Add our coinbase tx as first transaction
     pblock->vtx.push_back(txNew);
@@ -4359,109 +4933,88 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
         CBlockIndex* pindexPrev = pindexBest;
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority");
 
-        // This vector will be sorted into a priority queue:
+        // Transactions in the block so far, and those passed over in fee
+        // order until a parent is included
+        set<uint256> setInBlock;
+        set<uint256> setDeferred;
+
+        uint64 nBlockSize = 1000;
+        uint64 nBlockTx = 0;
+        int nBlockSigOps = 100;
+        bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+        // Sorted by priority, transactions without parents in the pool start
+        // in the queue and the others join it once their parents are in.
+        // Sorted by fee, the pool's fee rate index is walked instead and the
+        // queue only holds deferred transactions whose parents came later.
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        TxPriorityCompare comparer(fSortedByFee);
+        if (!fSortedByFee)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vecPriority.reserve(mempool.mapTx.size());
+            for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
             {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
+                const CTxMemPoolEntry& entry = (*mi).second;
+                if (entry.setParents.empty())
+                    vecPriority.push_back(TxPriority(entry.GetPriority(pindexPrev->nHeight), entry.dFeePerKb, &entry));
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
+        set<pair<double, uint256> >::const_reverse_iterator itFee = mempool.setByFeeRate.rbegin();
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+        loop
+        {
+            // Take the next transaction off the priority queue, or the best
+            // of the queue and the fee rate index:
+            double dPriority;
+            double dFeePerKb;
+            const CTxMemPoolEntry* pentry = NULL;
+            if (!vecPriority.empty() &&
+                (!fSortedByFee || itFee == mempool.setByFeeRate.rend() || vecPriority.front().get<1>() >= (*itFee).first))
+            {
+                dPriority = vecPriority.front().get<0>();
+                dFeePerKb = vecPriority.front().get<1>();
+                pentry = vecPriority.front().get<2>();
 
-            if (porphan)
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
+            }
+            else if (fSortedByFee && itFee != mempool.setByFeeRate.rend())
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find((*itFee).second);
+                ++itFee;
+                if (mi == mempool.mapTx.end())
+                    continue;
+                pentry = &(*mi).second;
+                dPriority = pentry->GetPriority(pindexPrev->nHeight);
+                dFeePerKb = pentry->dFeePerKb;
             }
             else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                break;
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            const CTransaction& tx = pentry->GetTx();
+            uint256 hash = tx.GetHash();
+            if (setInBlock.count(hash))
+                continue;
+            if (tx.IsCoinBase() || !tx.IsFinal())
+                continue;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            // Has to wait for dependencies
+            if (!HaveParentsInBlock(*pentry, setInBlock))
+            {
+                setDeferred.insert(hash);
+                continue;
+            }
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pentry->nTxSize;
             if (nBlockSize + nTxSize >= nBlockMaxSize)
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+            // Limits on sigOps:
+            unsigned int nTxSigOps = pentry->nSigOps;
             if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
                 continue;
 
@@ -4470,33 +5023,29 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
                 continue;
 
             // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
+            // transactions; whatever is left in the queue is met again in the fee rate index:
             if (!fSortedByFee &&
                 ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
             {
                 fSortedByFee = true;
                 comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.clear();
             }
 
             if (!tx.HaveInputs(view))
                 continue;
 
-            int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-            nTxSigOps += tx.GetP2SHSigOpCount(view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
+            // Scripts were verified when the transaction entered the pool, and
+            // the finished block is checked with ConnectBlock below
             CValidationState state;
-            if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+            if (!tx.CheckInputs(state, view, false))
                 continue;
 
             CTxUndo txundo;
-            uint256 hash = tx.GetHash();
             tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
 
             // Added
+            int64 nTxFees = pentry->nFee;
             pblock->vtx.push_back(tx);
             pblocktemplate->vTxFees.push_back(nTxFees);
             pblocktemplate->vTxSigOps.push_back(nTxSigOps);
@@ -4504,28 +5053,28 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
                 printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                       dPriority, dFeePerKb, hash.ToString().c_str());
             }
 
             // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            BOOST_FOREACH(const uint256& hashChild, pentry->setChildren)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
+                if (fSortedByFee && !setDeferred.count(hashChild))
+                    continue;
+                map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hashChild);
+                if (mi == mempool.mapTx.end())
+                    continue;
+                const CTxMemPoolEntry& child = (*mi).second;
+                if (!HaveParentsInBlock(child, setInBlock))
+                    continue;
+                setDeferred.erase(hashChild);
+                vecPriority.push_back(TxPriority(child.GetPriority(pindexPrev->nHeight), child.dFeePerKb, &child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
             }
         }
 
@@ -4547,6 +5096,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
         pblocktemplate->vTxFees[0] = -nFees;
 
         pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        pblock->vtx[0].InvalidateHash();
         pblocktemplate->vTxSigOps[0] = pblock->vtx[0].GetLegacySigOpCount();
 
         CBlockIndex indexDummy(*pblock);
@@ -4575,61 +5125,33 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateHash();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
 
-void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1)
+void FormatHashBuffers(CBlock* pblock, char* pdata, unsigned char* planes)
 {
     //
-    // Pre-build hash buffers
+    // Pre-build the getwork data buffer: the header as big endian words,
+    // zero padded to 128 bytes for miners that expect the old layout
     //
-    struct
-    {
-        struct unnamed2
-        {
-            int nVersion;
-            uint256 hashPrevBlock;
-            uint256 hashMerkleRoot;
-            unsigned int nTime;
-            unsigned int nBits;
-            unsigned int nNonce;
-        }
-        block;
-        unsigned char pchPadding0[64];
-        uint256 hash1;
-        unsigned char pchPadding1[64];
-    }
-    tmp;
-    memset(&tmp, 0, sizeof(tmp));
-
-    tmp.block.nVersion       = pblock->nVersion;
-    tmp.block.hashPrevBlock  = pblock->hashPrevBlock;
-    tmp.block.hashMerkleRoot = pblock->hashMerkleRoot;
-    tmp.block.nTime          = pblock->nTime;
-    tmp.block.nBits          = pblock->nBits;
-    tmp.block.nNonce         = pblock->nNonce;
-
-    FormatHashBlocks(&tmp.block, sizeof(tmp.block));
-    FormatHashBlocks(&tmp.hash1, sizeof(tmp.hash1));
-
-    // Byte swap all the input buffer
-    for (unsigned int i = 0; i < sizeof(tmp)/4; i++)
-        ((unsigned int*)&tmp)[i] = ReverseBytes(((unsigned int*)&tmp)[i]);
-
-    // Precalc the first half of the first hash, which stays constant
-    SHA256Transform(pmidstate, &tmp.block, pSHA256InitState);
-
-    memcpy(pdata, &tmp.block, 128);
-    memcpy(phash1, &tmp.hash1, 64);
+    memset(pdata, 0, 128);
+    memcpy(pdata, BEGIN(pblock->nVersion), HEADER_HASH_INPUT_SIZE);
+    for (unsigned int i = 0; i < HEADER_HASH_INPUT_SIZE/4; i++)
+        ((unsigned int*)pdata)[i] = ReverseBytes(((unsigned int*)pdata)[i]);
+
+    // The Keccak input for the whole header fits in one block, so the sponge
+    // state before the final permutation is just the padded header lanes
+    CHeaderHasher(*pblock).GetLaneBytes(planes);
 }
 
 
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
 
     if (hash > hashTarget)
         return false;
@@ -4664,6 +5186,9 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
+// Nonces hashed per call into the header hasher; a multiple of its lane count
+static const unsigned int MINER_NONCE_BATCH = 64;
+
 void static BitcoinMiner(CWallet *pwallet)
 {
     printf("MaxCoinMiner started\n");
@@ -4694,40 +5219,30 @@ void static BitcoinMiner(CWallet *pwallet)
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
         //
-        // Pre-build hash buffers
-        //
-/*
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-        unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
-
-        
-        //
-        // Search
+        // Search: the header is hashed MINER_NONCE_BATCH nonces at a time,
+        // several nonces per Keccak permutation where the CPU allows
         //
-
-        int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-        uint256 hashbuf[2];
-        uint256& hash = *alignup<16>(hashbuf);
-*/
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
         int64 nStart = GetTime();
-        uint256 hash;
-        // unsigned int nHashesDone = 0;
+        CHeaderHasher hasher(*pblock);
+        uint256 hashes[MINER_NONCE_BATCH];
         loop
         {
-//            unsigned int nNonceFound;
-
-            hash = pblock->GetHash();
-            if (hash <= hashTarget){
-                // nHashesDone += pblock->nNonce;
+            hasher.HashNonces(pblock->nNonce, MINER_NONCE_BATCH, hashes);
+            unsigned int nFound = MINER_NONCE_BATCH;
+            for (unsigned int i = 0; i < MINER_NONCE_BATCH; i++)
+            {
+                if (hashes[i] <= hashTarget)
+                {
+                    nFound = i;
+                    break;
+                }
+            }
+            if (nFound < MINER_NONCE_BATCH)
+            {
+                pblock->nNonce += nFound;
+                uint256 hash = pblock->GetHash();
+                assert(hash == hashes[nFound]);
                 SetThreadPriority(THREAD_PRIORITY_NORMAL);
 
                 printf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
@@ -4737,8 +5252,8 @@ void static BitcoinMiner(CWallet *pwallet)
                 SetThreadPriority(THREAD_PRIORITY_LOWEST);
                 break;
             }
-            ++pblock->nNonce;
-            
+            pblock->nNonce += MINER_NONCE_BATCH;
+
             // Meter hashes/sec
             static int64 nHashCounter;
             if (nHPSTimerStart == 0)
@@ -4747,8 +5262,7 @@ void static BitcoinMiner(CWallet *pwallet)
                 nHashCounter = 0;
             }
             else
-                // nHashCounter += nHashesDone;
-                nHashCounter += 1;
+                nHashCounter += MINER_NONCE_BATCH;
             if (GetTimeMillis() - nHPSTimerStart > 4000)
             {
                 static CCriticalSection cs;
@@ -4759,12 +5273,7 @@ void static BitcoinMiner(CWallet *pwallet)
                         dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
                         nHPSTimerStart = GetTimeMillis();
                         nHashCounter = 0;
-                        //static int64 nLogTime;
-                        //if (GetTime() - nLogTime > 30 * 60)
-                        //{
-                            // nLogTime = GetTime();
-                            printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        //}
+                        printf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
                     }
                 }
             }
@@ -4773,7 +5282,7 @@ void static BitcoinMiner(CWallet *pwallet)
             boost::this_thread::interruption_point();
             if (vNodes.empty())
                 break;
-            if (++pblock->nNonce >= 0xffff0000)
+            if (pblock->nNonce >= 0xffff0000)
                 break;
             if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                 break;
@@ -4782,12 +5291,11 @@ void static BitcoinMiner(CWallet *pwallet)
 
             // Update nTime every few seconds
             pblock->UpdateTime(pindexPrev);
-            //nBlockTime = ReverseBytes(pblock->nTime);
+            hasher.SetTime(pblock->nTime, pblock->nBits);
             if (fTestNet)
             {
                 // Changing pblock->nTime can change work required on testnet:
-                //nBlockBits = ReverseBytes(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
             }
         }
     } }
@@ -4882,10 +5390,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -7,12 +7,16 @@
 #define BITCOIN_MAIN_H
 
 #include "bignum.h"
+#include "arith_uint256.h"
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "hashmap.h"
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -58,6 +62,8 @@ static const int COINBASE_MATURITY = 120;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of script checks handed to the check queue at once, and the largest slice a worker takes */
+static const unsigned int SCRIPT_CHECK_BATCH_SIZE = 128;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -72,8 +78,16 @@ extern CScript COINBASE_FLAGS;
 
 
 
+/** Hash function for BlockMap.  Block hashes are proof-of-work outputs, so
+ *  their low 64 bits are already uniform */
+struct CBlockHasher
+{
+    size_t operator()(const uint256& hash) const { return (size_t)hash.Get64(0); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, CBlockHasher> BlockMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -97,7 +111,7 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 
 // Settings
 extern int64 nTransactionFee;
@@ -125,8 +139,8 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block; fCheckedBlock means the caller already ran CheckBlock on it successfully */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fCheckedBlock = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -147,6 +161,8 @@ bool VerifyDB();
 void PrintBlockTree();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** First block of the currently-connected chain that can hold transactions made at or after nTime */
+CBlockIndex* FindBlockByTime(int64 nTime);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
@@ -159,8 +175,8 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlockTemplate* CreateNewBlock(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
-/** Do mining precalculation */
-void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
+/** Do mining precalculation: the getwork data buffer and the Keccak input lanes (HEADER_HASH_LANES * 8 bytes) */
+void FormatHashBuffers(CBlock* pblock, char* pdata, unsigned char* planes);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -256,11 +272,11 @@ struct CDiskTxPos : public CDiskBlockPos
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -478,6 +494,24 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+private:
+    // Filled in when the transaction is deserialized, and copied along with
+    // it, so a transaction received or read from disk is only ever read.
+    // Code that changes a transaction must call InvalidateHash afterwards;
+    // the values are then worked out again on first use, so a transaction
+    // being built should have GetHash called before it is shared.
+    mutable uint256 hashCached;
+    mutable unsigned int nSizeCached;
+    mutable bool fHashCached;
+
+    void UpdateHash() const
+    {
+        hashCached = SerializeHash(*this);
+        nSizeCached = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        fHashCached = true;
+    }
+
+public:
     CTransaction()
     {
         SetNull();
@@ -490,6 +524,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            UpdateHash();
     )
 
     void SetNull()
@@ -498,6 +534,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        InvalidateHash();
     }
 
     bool IsNull() const
@@ -507,7 +544,23 @@ public:
 
     uint256 GetHash() const
     {
-        return SerializeHash(*this);
+        if (!fHashCached)
+            UpdateHash();
+        return hashCached;
+    }
+
+    // Serialized size, as used for fees, priority and size limits
+    unsigned int GetTxSize() const
+    {
+        if (!fHashCached)
+            UpdateHash();
+        return nSizeCached;
+    }
+
+    // Forget the cached hash and size after changing the transaction
+    void InvalidateHash()
+    {
+        fHashCached = false;
     }
 
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
@@ -1079,6 +1132,14 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory owned by this CCoins, including allocator overhead
+    size_t DynamicMemoryUsage() const {
+        size_t nUsage = MallocUsage(vout.capacity() * sizeof(CTxOut));
+        BOOST_FOREACH(const CTxOut &out, vout)
+            nUsage += MallocUsage(out.scriptPubKey.capacity());
+        return nUsage;
+    }
 };
 
 /** Closure representing one script verification
@@ -1616,6 +1677,9 @@ public:
     // (memory only) pointer to the index of the *active* successor of this block
     CBlockIndex* pnext;
 
+    // (memory only) pointer to an earlier ancestor, for GetAncestor
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -1641,6 +1705,11 @@ public:
     // Verification status of this block. See enum BlockStatus
     unsigned int nStatus;
 
+    // (memory only) nBits the gravity well retarget requires of a successor of
+    // this block, 0 until computed. It depends only on this block and its
+    // ancestors, so it stays valid across reorganizations
+    mutable unsigned int nBitsNext;
+
     // block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -1654,6 +1723,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1662,6 +1732,7 @@ public:
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
+        nBitsNext = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1675,6 +1746,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -1683,6 +1755,7 @@ public:
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
+        nBitsNext = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1732,13 +1805,21 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    arith_uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative, fOverflow;
+        arith_uint256 bnTarget;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1) does not fit in 256 bits, but it equals
+        // ~bnTarget / (bnTarget+1) + 1
+        arith_uint256 bnDivisor(bnTarget);
+        ++bnDivisor;
+        arith_uint256 bnWork(~bnTarget);
+        bnWork /= bnDivisor;
+        ++bnWork;
+        return bnWork;
     }
 
     bool IsInMainChain() const
@@ -1746,6 +1827,14 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Set pskip; pprev and nHeight must be set and pprev's pskip built
+    void BuildSkip();
+
+    // The ancestor of this block at nHeightIn, or NULL if nHeightIn is out
+    // of range; takes O(log n) steps through the skip pointers
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool CheckIndex() const
     {
         return CheckProofOfWork(GetBlockHash(), nBits);
@@ -1817,6 +1906,56 @@ struct CBlockIndexWorkComparator
     }
 };
 
+/** The active chain as a vector indexed by height, so the block at a given
+ *  height is found without walking pprev or pnext pointers */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    /** The block at nHeight, or NULL if the chain is not that long */
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    /** Height of the tip, -1 if the chain is empty */
+    int Height() const
+    {
+        return (int)vChain.size() - 1;
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Make pindex the tip; only the entries above the fork are rewritten */
+    void SetTip(CBlockIndex* pindex)
+    {
+        if (pindex == NULL) {
+            vChain.clear();
+            return;
+        }
+        vChain.resize(pindex->nHeight + 1);
+        while (pindex && vChain[pindex->nHeight] != pindex) {
+            vChain[pindex->nHeight] = pindex;
+            pindex = pindex->pprev;
+        }
+    }
+};
+
+/** The chain ending at pindexBest, updated together with the pnext pointers */
+extern CChain chainActive;
+
 
 
 /** Used to marshal pointers into hashes for db storage. */
@@ -1965,7 +2104,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2001,8 +2140,13 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            int nHeight = pindex->nHeight - nStep;
+            if (nHeight < 0)
+                pindex = NULL;
+            else if (chainActive.Contains(pindex))
+                pindex = chainActive[nHeight];
+            else
+                pindex = pindex->GetAncestor(nHeight);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -2016,7 +2160,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2035,7 +2179,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2051,7 +2195,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2078,15 +2222,52 @@ public:
 
 
 
+/** A transaction in the memory pool, with what block templates need to
+ * know about it worked out once when it is added.
+ */
+class CTxMemPoolEntry
+{
+public:
+    // Shared with the relay cache and never modified
+    CTransactionRef ptx;
+    int64 nFee;
+    unsigned int nTxSize;
+    unsigned int nSigOps; // legacy and P2SH
+    double dFeePerKb;
+    // Priority at chain height nHeight, and the value of the inputs that
+    // are in the chain; their age grows by one with every block.  Both are
+    // worked out again when a parent enters or leaves the pool.
+    double dPriority;
+    int64 nValueInChain;
+    int nHeight;
+    // Transactions in the pool that this one spends, and that spend it
+    std::set<uint256> setParents;
+    std::set<uint256> setChildren;
+
+    CTxMemPoolEntry() : nFee(0), nTxSize(0), nSigOps(0), dFeePerKb(0), dPriority(0), nValueInChain(0), nHeight(0) {}
+
+    const CTransaction& GetTx() const { return *ptx; }
+
+    // Priority of the transaction in a block on top of height nCurrentHeight,
+    // counting inputs in the pool as having no age
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    // All entries by fee per kilobyte, lowest first
+    std::set<std::pair<double, uint256> > setByFeeRate;
 
     bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, const CTransaction &tx);
+    void UpdatePriority(CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
@@ -2104,9 +2285,20 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    // requires exists(hash)
+    const CTransaction& lookup(uint256 hash) const
     {
-        return mapTx[hash];
+        return mapTx.find(hash)->second.GetTx();
+    }
+
+    // The shared transaction, or NULL if it is not in the pool; it stays
+    // valid after cs is released
+    CTransactionRef get(uint256 hash) const
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            return CTransactionRef();
+        return mi->second.ptx;
     }
 };
 
@@ -2125,6 +2317,72 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** A CCoins held by a CCoinsViewCache */
+struct CCoinsCacheEntry
+{
+    CCoins coins;
+    unsigned char flags;
+
+    // Outputs spent since the entry was read from the parent view, when
+    // that is its only change (SPENT without DIRTY)
+    std::vector<unsigned int> vSpent;
+
+    enum Flags {
+        DIRTY = (1 << 0), // differs from the version in the parent view as a whole
+        FRESH = (1 << 1), // the parent view has no unspent version, so it can be dropped once pruned
+        SPENT = (1 << 2), // the outputs in vSpent were spent
+    };
+
+    CCoinsCacheEntry() : coins(), flags(0) { }
+
+    bool IsModified() const {
+        return (flags & (DIRTY | SPENT)) != 0;
+    }
+
+    // Record that the whole entry changed
+    void SetDirty() {
+        flags = (flags & ~SPENT) | DIRTY;
+        std::vector<unsigned int>().swap(vSpent);
+    }
+
+    // Record that output n was spent
+    void SetSpent(unsigned int n) {
+        if (flags & DIRTY)
+            return;
+        flags |= SPENT;
+        vSpent.push_back(n);
+    }
+
+    size_t DynamicMemoryUsage() const {
+        return coins.DynamicMemoryUsage() + MallocUsage(vSpent.capacity() * sizeof(unsigned int));
+    }
+
+    void swap(CCoinsCacheEntry &to) {
+        coins.swap(to.coins);
+        std::swap(flags, to.flags);
+        vSpent.swap(to.vSpent);
+    }
+};
+
+/** Hash for txids in a CCoinsMap. Txids are already uniformly distributed,
+    so they only need mixing with a per-process secret salt to keep peers
+    from creating transactions that all fall into one probe sequence. */
+class CCoinsKeyHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CCoinsKeyHasher();
+
+    size_t operator()(const uint256 &txid) const {
+        uint64 h = (txid.Get64(0) ^ k0) * 0x9E3779B97F4A7C15ULL + (txid.Get64(1) ^ k1) * 0xC2B2AE3D27D4EB4FULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+typedef COpenHashMap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2145,8 +2403,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock); only
+    // entries in mapCoins that are DIRTY or have SPENT outputs are applied
+    virtual bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2169,7 +2428,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2178,7 +2437,16 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Heap memory owned by the CCoins in cacheCoins
+    size_t cachedCoinsUsage;
+
+    // The entry last returned by the modifying GetCoins; the caller may
+    // change its size until the next call, so it is re-measured then
+    bool fModified;
+    uint256 hashModified;
+    size_t nModifiedUsage;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2189,13 +2457,25 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
+
+    // Add the outputs of a new transaction. If the parent views hold
+    // nothing for its txid, they need not be written back if spent here.
+    bool SetNewCoins(const uint256 &txid, const CCoins &coins);
+
+    // Mark an outpoint spent and construct its undo information. Unlike
+    // changing the CCoins through GetCoins, only this output is written back.
+    bool SpendCoins(const COutPoint &out, CTxInUndo &undo);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The reference is only valid until the next call on this cache.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins, without marking it modified.
+    // Check HaveCoins first. The reference is only valid until the next call on this cache.
+    const CCoins &AccessCoins(const uint256 &txid);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -2203,8 +2483,12 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Calculate the heap memory used by the cache, in bytes
+    size_t DynamicMemoryUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
+    void UpdateModifiedUsage();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
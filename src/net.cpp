@@ -29,8 +29,11 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 15;
+static const int MAX_MESSAGE_THREADS = 16;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void SocketEngineAdd(CNode* pnode);
+static void SocketEngineRemove(CNode* pnode);
 
 
 struct LocalServiceInfo {
@@ -56,7 +59,7 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -498,6 +501,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        SocketEngineAdd(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -519,6 +523,7 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+        SocketEngineRemove(this);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -748,69 +753,473 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+// Wakes ThreadMessageHandler when a message has been received
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static bool fMsgProcWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+        fMsgProcWake = true;
+    }
+    condMsgProc.notify_one();
+}
+
+#ifdef USE_EPOLL
+// Readiness of all peer sockets, and an eventfd to wake ThreadSocketHandler
+static int hEpoll = -1;
+static int hSocketWake = -1;
+#endif
+
+// Start watching the socket of a new node; call before adding it to vNodes
+static void SocketEngineAdd(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    // Edge-triggered: an event only arrives when a socket becomes readable
+    // or writable again, so it has to be read or written until it would block
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+        printf("SocketEngineAdd() : epoll_ctl failed, error %d\n", errno);
+#endif
+}
+
+// Stop watching the socket of a node; call before closing it.  Closing alone
+// is not enough while a forked child still holds a copy of the descriptor.
+static void SocketEngineRemove(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, &event);
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    uint64_t nOne = 1;
+    if (write(hSocketWake, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+        printf("WakeSocketHandler() : write failed, error %d\n", errno);
+#endif
+}
+
+static void DisconnectNodes()
+{
+    LOCK(cs_vNodes);
+    // Disconnect unused nodes
+    vector<CNode*> vNodesCopy = vNodes;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->fDisconnect ||
+            (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+        {
+            // remove from vNodes
+            vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+            // release outbound grant (if any)
+            pnode->grantOutbound.Release();
+
+            // close socket and cleanup
+            pnode->CloseSocketDisconnect();
+            pnode->Cleanup();
+
+            // hold in disconnected pool until all refs are released
+            if (pnode->fNetworkNode || pnode->fInbound)
+                pnode->Release();
+            vNodesDisconnected.push_back(pnode);
+        }
+    }
+
+    // Delete disconnected nodes
+    list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+    BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    {
+        // wait until threads are done using it
+        if (pnode->GetRefCount() <= 0)
+        {
+            bool fDelete = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
+                    {
+                        TRY_LOCK(pnode->cs_inventory, lockInv);
+                        if (lockInv)
+                            fDelete = true;
+                    }
+                }
+            }
+            if (fDelete)
+            {
+                vNodesDisconnected.remove(pnode);
+                delete pnode;
+            }
+        }
+    }
+}
+
+static void AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        SocketEngineAdd(pnode);
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Read once from the socket; returns false if it had nothing to read
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+            WakeMessageHandler();
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// requires LOCK(cs_vRecvMsg)
+// True if received messages are waiting to be processed and no more
+// should be read for now
+static bool ReceiveFlooded(CNode* pnode)
+{
+    return !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+           pnode->GetTotalRecvSize() > ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+
+enum
+{
+    SERVICE_DONE,   // everything epoll reported has been handled
+    SERVICE_RETRY,  // a lock was busy or reading was cut short; try again soon
+    SERVICE_WAIT,   // waiting for the message handler or for a write event
+};
+
+// Handle the readiness recorded in pnode->fRecvReady and fSendReady
+static int ServiceSocket(CNode* pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return SERVICE_DONE;
+
+    bool fRetry = false;
+    bool fSendPending = false;
+
+    //
+    // Send
+    //
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (pnode->fSendReady)
+            {
+                // Drains until the socket would block; an empty queue is
+                // written optimistically by EndMessage, so either way the
+                // next write event is the one to wait for
+                SocketSendData(pnode);
+                pnode->fSendReady = false;
+            }
+            fSendPending = !pnode->vSendMsg.empty();
+        }
+        else if (pnode->fSendReady)
+            fRetry = true;
+    }
+
+    //
+    // Receive
+    //
+    // As with select(), a peer we cannot send to is not read from until its
+    // send queue drains, and reading stops while its received messages
+    // exceed -maxreceivebuffer; the message handler wakes us when they don't.
+    if (pnode->fRecvReady && !fSendPending && pnode->hSocket != INVALID_SOCKET)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            // Bound the reads per pass so one busy peer can't starve the rest
+            for (int i = 0; i < 4 && pnode->fRecvReady; i++)
+            {
+                pnode->fPauseRecv = ReceiveFlooded(pnode);
+                if (pnode->fPauseRecv)
+                    break;
+                pnode->fRecvReady = SocketRecvData(pnode);
+            }
+            if (pnode->fRecvReady && !pnode->fPauseRecv)
+                fRetry = true;
+        }
+        else
+            fRetry = true;
+    }
+
+    if (pnode->hSocket == INVALID_SOCKET)
+        return SERVICE_DONE;
+    if (fRetry)
+        return SERVICE_RETRY;
+    if (pnode->fRecvReady || pnode->fSendReady)
+        return SERVICE_WAIT;
+    return SERVICE_DONE;
+}
+
 void ThreadSocketHandler()
 {
+    static const int MAX_EVENTS = 256;
+    struct epoll_event events[MAX_EVENTS];
+    // Nodes with readiness not handled yet, each holding a reference
+    vector<CNode*> vNodesReady;
+    int nTimeout = 0;
+    int64 nLastInactivityCheck = 0;
     unsigned int nPrevNodeCount = 0;
+
+    // Level-triggered, so one connection is accepted per event; the listen
+    // sockets are told apart from peers by a NULL node pointer
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == SOCKET_ERROR)
+            printf("ThreadSocketHandler() : epoll_ctl failed, error %d\n", errno);
+    }
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &hSocketWake;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocketWake, &event) == SOCKET_ERROR)
+            printf("ThreadSocketHandler() : epoll_ctl failed, error %d\n", errno);
+    }
+
     loop
     {
         //
         // Disconnect nodes
         //
+        DisconnectNodes();
+        if (vNodes.size() != nPrevNodeCount)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+            nPrevNodeCount = vNodes.size();
+            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+        //
+        // Wait for sockets to become ready
+        //
+        int nEvents = epoll_wait(hEpoll, events, MAX_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+        if (nEvents == SOCKET_ERROR)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
             }
+            nEvents = 0;
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        bool fAccept = false;
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; i++)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                void* ptr = events[i].data.ptr;
+                if (ptr == NULL)
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                    fAccept = true;
+                    continue;
                 }
+                if (ptr == &hSocketWake)
+                {
+                    // Waiting nodes are serviced below anyway
+                    uint64_t nCount;
+                    if (read(hSocketWake, &nCount, sizeof(nCount)) != sizeof(nCount) && errno != EAGAIN)
+                        printf("socket eventfd read error %d\n", errno);
+                    continue;
+                }
+                CNode* pnode = (CNode*)ptr;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fRecvReady = true;
+                if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    pnode->fSendReady = true;
+                if (!pnode->fSocketQueued)
+                {
+                    pnode->fSocketQueued = true;
+                    vNodesReady.push_back(pnode->AddRef());
+                }
+            }
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
             }
         }
+
+        //
+        // Service each ready socket
+        //
+        bool fRetry = false;
+        vector<CNode*> vNodesWaiting;
+        vector<CNode*> vNodesDone;
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+        {
+            boost::this_thread::interruption_point();
+
+            int nResult = ServiceSocket(pnode);
+            if (nResult == SERVICE_DONE)
+            {
+                pnode->fSocketQueued = false;
+                vNodesDone.push_back(pnode);
+                continue;
+            }
+            if (nResult == SERVICE_RETRY)
+                fRetry = true;
+            vNodesWaiting.push_back(pnode);
+        }
+        vNodesReady.swap(vNodesWaiting);
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
+                pnode->Release();
+        }
+
+        //
+        // Inactivity checking
+        //
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    InactivityCheck(pnode);
+        }
+
+        // Sleep until there is something to do, but come back regularly to
+        // clean up disconnected nodes
+        nTimeout = fRetry ? 10 : 200;
+    }
+}
+
+#else
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes();
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
@@ -873,9 +1282,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && !ReceiveFlooded(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -904,59 +1311,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -982,38 +1338,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1031,26 +1356,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1062,6 +1368,8 @@ void ThreadSocketHandler()
     }
 }
 
+#endif
+
 
 
 
@@ -1599,6 +1907,87 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Nodes waiting for a message handler worker, with whether to trickle to
+// them.  A node is queued at most once (CNode::fMsgScheduled), so each
+// node's messages are still processed one at a time and in order.
+static boost::mutex mutexMsgWork;
+static boost::condition_variable condMsgWork;
+static deque<pair<CNode*, bool> > queueMsgWork;
+
+// Process received messages and send messages for one node; returns true
+// if it has more work ready
+static bool ProcessNode(CNode* pnode, bool fSendTrickle)
+{
+    bool fMore = false;
+    if (pnode->fDisconnect)
+        return false;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            if (!ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            // Let the socket thread read again once there is room
+            if (pnode->fPauseRecv && !ReceiveFlooded(pnode))
+                WakeSocketHandler();
+
+            if (pnode->nSendSize < SendBufferSize())
+            {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                {
+                    fMore = true;
+                }
+            }
+        }
+        else
+            fMore = true;
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            SendMessages(pnode, fSendTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMore;
+}
+
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        pair<CNode*, bool> work;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgWork);
+            while (queueMsgWork.empty())
+                condMsgWork.wait(lock);
+            work = queueMsgWork.front();
+            queueMsgWork.pop_front();
+        }
+        CNode* pnode = work.first;
+
+        bool fMore = ProcessNode(pnode, work.second);
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMsgWork);
+            pnode->fMsgScheduled = false;
+        }
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        if (fMore)
+            WakeMessageHandler();
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1620,54 +2009,44 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Hand the nodes to the workers.  A node still being processed from
+        // an earlier pass is skipped, so a slow message only holds up its own
+        // peer; the worker wakes us if that peer has more to do.
+        vector<CNode*> vNodesSkipped;
         {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
+            boost::lock_guard<boost::mutex> lock(mutexMsgWork);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (pnode->fDisconnect || pnode->fMsgScheduled)
                 {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
+                    vNodesSkipped.push_back(pnode);
+                    continue;
                 }
+                // The worker releases the reference taken above
+                pnode->fMsgScheduled = true;
+                queueMsgWork.push_back(make_pair(pnode, pnode == pnodeTrickle));
             }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
-            }
-            boost::this_thread::interruption_point();
         }
+        condMsgWork.notify_all();
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vNodesSkipped)
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        // Wait for a message to be received or for a worker with more work,
+        // or at most 100ms so SendMessages still runs regularly
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            if (!fMsgProcWake)
+                condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMsgProcWake = false;
+        }
     }
 }
 
@@ -1842,6 +2221,16 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create(nMaxConnections + 16);
+        hSocketWake = eventfd(0, EFD_NONBLOCK);
+        if (hEpoll == -1 || hSocketWake == -1)
+            throw runtime_error(strprintf("StartNode() : epoll_create or eventfd failed, error %d", errno));
+    }
+#endif
+
     Discover();
 
     //
@@ -1869,6 +2258,13 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageThreads = GetArg("-msgthreads", 0);
+    if (nMessageThreads <= 0)
+        nMessageThreads += boost::thread::hardware_concurrency();
+    nMessageThreads = max(1, min(nMessageThreads, MAX_MESSAGE_THREADS));
+    printf("Using %d message handler threads\n", nMessageThreads);
+    for (int i = 0; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1905,6 +2301,12 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        if (hSocketWake != -1)
+            close(hSocketWake);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1934,14 +2336,20 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    // Share the memory pool's instance when there is one
+    CTransactionRef ptx;
+    {
+        LOCK(mempool.cs);
+        ptx = mempool.get(hash);
+    }
+    if (!ptx)
+        ptx.reset(new CTransaction(tx));
+    RelayTransaction(ptx, hash);
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx, const uint256& hash)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, hash);
     {
         LOCK(cs_mapRelay);
@@ -1952,8 +2360,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        mapRelay.insert(std::make_pair(inv, ptx));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
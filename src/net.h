@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -24,8 +25,13 @@
 
 class CNode;
 class CBlockIndex;
+class CTransaction;
 extern int nBestHeight;
 
+/** A transaction shared read-only between the memory pool, the relay cache
+ *  and whoever else needs it, instead of being copied */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
 
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
@@ -44,6 +50,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeMessageHandler();
+void WakeSocketHandler();
 
 enum
 {
@@ -78,7 +86,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -169,6 +177,17 @@ public:
     uint64 nRecvBytes;
     int nRecvVersion;
 
+    // Socket readiness not handled yet and whether the node is queued for
+    // it; only used by ThreadSocketHandler with epoll
+    bool fRecvReady;
+    bool fSendReady;
+    bool fSocketQueued;
+    // Reading stopped until the received messages are processed
+    // requires LOCK(cs_vRecvMsg)
+    bool fPauseRecv;
+    // Queued for or being processed by a message handler worker
+    bool fMsgScheduled;
+
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
@@ -248,6 +267,11 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fRecvReady = false;
+        fSendReady = false;
+        fSocketQueued = false;
+        fPauseRecv = false;
+        fMsgScheduled = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -634,8 +658,7 @@ public:
 
 
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx, const uint256& hash);
 
 #endif
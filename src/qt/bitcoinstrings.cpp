@@ -98,6 +98,7 @@ QT_TRANSLATE_NOOP("maxcoin-core", "Cannot downgrade wallet"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Cannot resolve -bind address: '%s'"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Cannot resolve -externalip address: '%s'"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Cannot write default address"),
+QT_TRANSLATE_NOOP("maxcoin-core", "Checking wallet keys... %d%%"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Connect only to the specified node(s)"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Connect through socks proxy"),
 QT_TRANSLATE_NOOP("maxcoin-core", "Connect to a node to retrieve peer addresses, and disconnect"),
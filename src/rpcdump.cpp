@@ -34,10 +34,12 @@ public:
 
 Value importprivkey(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 3)
+    if (fHelp || params.size() < 1 || params.size() > 4)
         throw runtime_error(
-            "importprivkey <maxcoinprivkey> [label] [rescan=true]\n"
-            "Adds a private key (as returned by dumpprivkey) to your wallet.");
+            "importprivkey <maxcoinprivkey> [label] [rescan=true] [birthtime]\n"
+            "Adds a private key (as returned by dumpprivkey) to your wallet.\n"
+            "If [birthtime] is given, the rescan starts at the first block that can hold\n"
+            "transactions made at or after that time (seconds since 1 Jan 1970 GMT).");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
@@ -49,6 +51,11 @@ Value importprivkey(const Array& params, bool fHelp)
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
+    // Where to start the rescan, the genesis block if the key's age is unknown
+    int64 nBirthTime = 0;
+    if (params.size() > 3)
+        nBirthTime = params[3].get_int64();
+
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -62,14 +69,19 @@ Value importprivkey(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
-        pwalletMain->MarkDirty();
         pwalletMain->SetAddressBookName(vchAddress, strLabel);
 
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+
+        // Outputs already in the wallet may pay to the key; this also
+        // rebuilds the index of unspent outputs
+        pwalletMain->MarkDirty();
 	
         if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+            CBlockIndex* pindexStart = nBirthTime > 0 ? FindBlockByTime(nBirthTime) : pindexGenesisBlock;
+            if (pindexStart)
+                pwalletMain->ScanForWalletTransactions(pindexStart, true);
             pwalletMain->ReacceptWalletTransactions();
         }
     }
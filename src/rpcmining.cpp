@@ -8,6 +8,7 @@
 #include "db.h"
 #include "init.h"
 #include "bitcoinrpc.h"
+#include "headerhash.h"
 
 using namespace json_spirit;
 using namespace std;
@@ -143,9 +144,9 @@ Value getwork(const Array& params, bool fHelp)
         throw runtime_error(
             "getwork [data]\n"
             "If [data] is not specified, returns formatted hash data to work on:\n"
-            "  \"midstate\" : precomputed hash state after hashing the first half of the data (DEPRECATED)\n" // deprecated
             "  \"data\" : block data\n"
-            "  \"hash1\" : formatted hash buffer for second hash (DEPRECATED)\n" // deprecated
+            "  \"lanes\" : Keccak input block for the header, nonce set to zero\n"
+            "  \"nonceoffset\" : byte offset of the little endian nonce in lanes\n"
             "  \"target\" : little endian hash target\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
@@ -209,17 +210,16 @@ Value getwork(const Array& params, bool fHelp)
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
 
         // Pre-build hash buffers
-        char pmidstate[32];
         char pdata[128];
-        char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        unsigned char planes[HEADER_HASH_LANES * 8];
+        FormatHashBuffers(pblock, pdata, planes);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
 
         Object result;
-        result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
-        result.push_back(Pair("hash1",    HexStr(BEGIN(phash1), END(phash1)))); // deprecated
+        result.push_back(Pair("lanes",    HexStr(BEGIN(planes), END(planes))));
+        result.push_back(Pair("nonceoffset", (int)HEADER_HASH_NONCE_OFFSET));
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
         return result;
     }
@@ -243,6 +243,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].InvalidateHash();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         return CheckWork(pblock, *pwalletMain, *pMiningKey);
@@ -256,6 +257,9 @@ Value getwork2(const Array& params, bool fHelp)
             "getwork2 [data]\n"
             "If [data] is not specified, returns formatted hash data to work on:\n"
             "  \"data\" : block data\n"
+            "  \"lanes\" : Keccak input block for the header, nonce set to zero\n"
+            "  \"nonceoffset\" : byte offset of the little endian nonce in lanes\n"
+            "  \"noncerange\" : range of nonces to search\n"
             "  \"target\" : little endian hash target\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
@@ -320,12 +324,18 @@ Value getwork2(const Array& params, bool fHelp)
 
         // Pre-build hash buffers
         char pdata[128];
-        memcpy(pdata, pblock, 80);
+        memset(pdata, 0, sizeof(pdata));
+        memcpy(pdata, BEGIN(pblock->nVersion), HEADER_HASH_INPUT_SIZE);
+        unsigned char planes[HEADER_HASH_LANES * 8];
+        CHeaderHasher(*pblock).GetLaneBytes(planes);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
 
         Object result;
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
+        result.push_back(Pair("lanes",    HexStr(BEGIN(planes), END(planes))));
+        result.push_back(Pair("nonceoffset", (int)HEADER_HASH_NONCE_OFFSET));
+        result.push_back(Pair("noncerange", "00000000ffffffff"));
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
         return result;
     }
@@ -345,12 +355,16 @@ Value getwork2(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].InvalidateHash();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         return CheckWork(pblock, *pwalletMain, *pMiningKey);
     }
 }
 
+// Guards the template getblocktemplate keeps between calls, and its extra nonce
+static CCriticalSection cs_getblocktemplate;
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -371,6 +385,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"coinbasetxn\" : coinbase transaction matching \"lanes\"\n"
+            "  \"lanes\" : Keccak input block for the template header with coinbasetxn, nonce set to zero\n"
+            "  \"nonceoffset\" : byte offset of the little endian nonce in lanes\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
@@ -398,6 +415,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "MaxCoin is downloading blocks...");
 
     // Update block
+    LOCK(cs_getblocktemplate);
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
@@ -423,6 +441,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
+        // Give the template coinbase its height and a merkle root, so the
+        // header lanes below describe a block that can be submitted as is
+        static unsigned int nExtraNonce = 0;
+        IncrementExtraNonce(&pblocktemplate->block, pindexPrevNew, nExtraNonce);
+
         // Need to update only after we know CreateNewBlock succeeded
         pindexPrev = pindexPrevNew;
     }
@@ -433,6 +456,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     pblock->nNonce = 0;
 
     Array transactions;
+    Object coinbasetxn;
     map<uint256, int64_t> setTxIndex;
     int i = 0;
     BOOST_FOREACH (CTransaction& tx, pblock->vtx)
@@ -440,9 +464,6 @@ Value getblocktemplate(const Array& params, bool fHelp)
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
-        if (tx.IsCoinBase())
-            continue;
-
         Object entry;
 
         CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
@@ -463,13 +484,16 @@ Value getblocktemplate(const Array& params, bool fHelp)
         entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
         entry.push_back(Pair("sigops", pblocktemplate->vTxSigOps[index_in_template]));
 
-        transactions.push_back(entry);
+        if (tx.IsCoinBase())
+            coinbasetxn = entry;
+        else
+            transactions.push_back(entry);
     }
 
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits).getuint256();
 
     static Array aMutable;
     if (aMutable.empty())
@@ -495,6 +519,12 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
 
+    unsigned char planes[HEADER_HASH_LANES * 8];
+    CHeaderHasher(*pblock).GetLaneBytes(planes);
+    result.push_back(Pair("coinbasetxn", coinbasetxn));
+    result.push_back(Pair("lanes", HexStr(BEGIN(planes), END(planes))));
+    result.push_back(Pair("nonceoffset", (int)HEADER_HASH_NONCE_OFFSET));
+
     return result;
 }
 
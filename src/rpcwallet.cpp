@@ -381,12 +381,12 @@ Value verifymessage(const Array& params, bool fHelp)
     ss << strMessageMagic;
     ss << strMessage;
 
-    CKey key;
-    key.SetPubKey(CPubKey(vchPubKey));
-    if (!key.Verify(ss.GetHash(), vchSig))
+    // Addresses are derived from the uncompressed encoding
+    CPubKey pubkey(vchPubKey);
+    if (!pubkey.Decompress() || !pubkey.Verify(ss.GetHash(), vchSig))
         return false;
 
-    return (key.GetPubKey().GetID() == keyID);
+    return (pubkey.GetID() == keyID);
 }
 
 
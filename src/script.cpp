@@ -3,7 +3,8 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -1023,62 +1024,155 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are 128-bit tags taken from a salted SHA-256 digest of
+// (signature hash, signature, public key), with the length of the last two
+// in front of them so no other split of the same bytes gives that digest.
+// They are stored four to a 64-byte bucket so a lookup touches one cache
+// line, and buckets are guarded by one of CACHE_LOCKS mutexes, so threads
+// only wait on each other when they land on the same stripe.
+// The salt is secret, so peers cannot aim entries at one bucket.
+
+// Upper bound for -maxsigcachesize, in megabytes; older releases took the
+// option as an entry count, and such values must not turn into gigabytes
+static const int64 MAX_SIG_CACHE_SIZE = 1024;
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    enum { TAG_WORDS = 4, BUCKET_ENTRIES = 4, CACHE_LOCKS = 64 };
 
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    struct Bucket
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint32_t tags[BUCKET_ENTRIES][TAG_WORDS];
+    };
 
+    std::vector<unsigned char> vMemory;
+    Bucket* buckets;
+    uint64 nBucketMask;
+    SHA256_CTX ctxSalted;
+    boost::mutex cs[CACHE_LOCKS];
 
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    static void HashField(SHA256_CTX* pctx, const std::vector<unsigned char>& vch)
+    {
+        unsigned int nSize = vch.size();
+        unsigned char size[4] = { (unsigned char)nSize, (unsigned char)(nSize >> 8),
+                                  (unsigned char)(nSize >> 16), (unsigned char)(nSize >> 24) };
+        SHA256_Update(pctx, size, sizeof(size));
+        SHA256_Update(pctx, vch.empty() ? NULL : &vch[0], vch.size());
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    void ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey,
+                      uint64& nIndex, uint32_t* tag, unsigned int& nSlot) const
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        SHA256_CTX ctx = ctxSalted;
+        SHA256_Update(&ctx, hash.begin(), hash.size());
+        HashField(&ctx, vchSig);
+        HashField(&ctx, pubKey);
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256_Final(digest, &ctx);
+
+        memcpy(&nIndex, digest, sizeof(nIndex));
+        nIndex &= nBucketMask;
+        memcpy(tag, digest + 8, TAG_WORDS * sizeof(uint32_t));
+        if ((tag[0] | tag[1] | tag[2] | tag[3]) == 0)
+            tag[0] = 1; // all-zero marks an empty slot
+        nSlot = digest[24] % BUCKET_ENTRIES;
+    }
 
-        
+    static bool Match(const Bucket* pbucket, unsigned int i, const uint32_t* tag)
+    {
+        for (unsigned int j = 0; j < TAG_WORDS; j++)
+            if (pbucket->tags[i][j] != tag[j])
+                return false;
+        return true;
+    }
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+public:
+    CSignatureCache()
+    {
+        buckets = NULL;
+        nBucketMask = 0;
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        // -maxsigcachesize is in megabytes; the bucket count is rounded
+        // down to a power of two
+        int64 nMaxCacheSizeMB = GetArg("-maxsigcachesize", 16);
+        if (nMaxCacheSizeMB > MAX_SIG_CACHE_SIZE)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            printf("CSignatureCache() : -maxsigcachesize=%"PRI64d" is above the maximum, using %"PRI64d" MB\n",
+                   nMaxCacheSizeMB, MAX_SIG_CACHE_SIZE);
+            nMaxCacheSizeMB = MAX_SIG_CACHE_SIZE;
         }
+        int64 nMaxCacheSize = nMaxCacheSizeMB << 20;
+        if (nMaxCacheSize < (int64)sizeof(Bucket))
+            return;
+        uint64 nBuckets = 1;
+        while (nBuckets * 2 * sizeof(Bucket) <= (uint64)nMaxCacheSize)
+            nBuckets *= 2;
+
+        // Align the table to a cache line
+        vMemory.resize(nBuckets * sizeof(Bucket) + 64, 0);
+        buckets = (Bucket*)(((uintptr_t)&vMemory[0] + 63) & ~(uintptr_t)63);
+        nBucketMask = nBuckets - 1;
+
+        unsigned char salt[64];
+        RAND_bytes(salt, sizeof(salt));
+        SHA256_Init(&ctxSalted);
+        SHA256_Update(&ctxSalted, salt, sizeof(salt));
+    }
 
-        
+    // Returns whether the entry is present; with fErase a hit is removed,
+    // as a signature is not expected to be checked again once in a block
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey, bool fErase)
+    {
+        if (!buckets)
+            return false;
+
+        uint64 nIndex;
+        uint32_t tag[TAG_WORDS];
+        unsigned int nSlot;
+        ComputeEntry(hash, vchSig, pubKey, nIndex, tag, nSlot);
+        Bucket* pbucket = &buckets[nIndex];
+        boost::unique_lock<boost::mutex> lock(cs[nIndex % CACHE_LOCKS]);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        for (unsigned int i = 0; i < BUCKET_ENTRIES; i++)
+        {
+            if (Match(pbucket, i, tag))
+            {
+                if (fErase)
+                    for (unsigned int j = 0; j < TAG_WORDS; j++)
+                        pbucket->tags[i][j] = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    {
+        if (!buckets)
+            return;
+
+        uint64 nIndex;
+        uint32_t tag[TAG_WORDS];
+        unsigned int nSlot;
+        ComputeEntry(hash, vchSig, pubKey, nIndex, tag, nSlot);
+        Bucket* pbucket = &buckets[nIndex];
+        boost::unique_lock<boost::mutex> lock(cs[nIndex % CACHE_LOCKS]);
+
+        // Take an empty slot if there is one, otherwise evict the slot the
+        // digest picks; which entry goes is unpredictable without the salt
+        for (unsigned int i = 0; i < BUCKET_ENTRIES; i++)
+        {
+            unsigned int n = (nSlot + i) % BUCKET_ENTRIES;
+            if ((pbucket->tags[n][0] | pbucket->tags[n][1] | pbucket->tags[n][2] | pbucket->tags[n][3]) == 0)
+            {
+                nSlot = n;
+                break;
+            }
+        }
+        for (unsigned int j = 0; j < TAG_WORDS; j++)
+            pbucket->tags[nSlot][j] = tag[j];
     }
 };
 
@@ -1098,18 +1192,14 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+    if (signatureCache.Get(sighash, vchSig, vchPubKey, flags & SCRIPT_VERIFY_NOCACHE))
         return true;
 
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
-
-    if (!key.Verify(sighash, vchSig))
+    if (!CPubKey(vchPubKey).Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, vchPubKey);;
+        signatureCache.Set(sighash, vchSig, vchPubKey);
 
     return true;
 }
@@ -1441,8 +1531,38 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
     return boost::apply_visitor(CKeyStoreIsMineVisitor(&keystore), dest);
 }
 
+// Pay-to-pubkey-hash, and pay-to-pubkey with a public key of the usual sizes,
+// in the form the keystore indexes them
+static bool IsIndexedKeyScript(const CScript& script)
+{
+    unsigned int n = script.size();
+    if (n == 25)
+        return (script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+                script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG);
+    if (n == 35 || n == 67)
+        return script[0] == n - 2 && script[n - 1] == OP_CHECKSIG;
+    return false;
+}
+
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // One lookup decides for the usual scripts paying to our keys...
+    if (keystore.HaveScriptPubKey(scriptPubKey))
+        return true;
+    // ...and for pay-to-script-hash, one more for whether we know the script
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        CScript subscript;
+        if (!keystore.GetCScript(CScriptID(uint160(valtype(scriptPubKey.begin() + 2, scriptPubKey.begin() + 22))), subscript))
+            return false;
+        return IsMine(keystore, subscript);
+    }
+    // Every key is indexed in these forms, and anything else we can spend
+    // ends in a signature check; only the rest needs the Solver
+    if (IsIndexedKeyScript(scriptPubKey) || scriptPubKey.empty() ||
+        (scriptPubKey.back() != OP_CHECKSIG && scriptPubKey.back() != OP_CHECKMULTISIG))
+        return false;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     
@@ -1598,7 +1718,9 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    bool fSolved = Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType);
+    txTo.InvalidateHash();
+    if (!fSolved)
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -1612,11 +1734,12 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
-        bool fSolved =
+        bool fSubSolved =
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
         txin.scriptSig << static_cast<valtype>(subscript);
-        if (!fSolved) return false;
+        txTo.InvalidateHash();
+        if (!fSubSolved) return false;
     }
 
     // Test solution
@@ -1885,8 +2008,7 @@ bool CScriptCompressor::IsToPubKey(std::vector<unsigned char> &pubkey) const
                             && script[1] == 0x04) {
         pubkey.resize(65);
         memcpy(&pubkey[0], &script[1], 65);
-        CKey key;
-        return (key.SetPubKey(CPubKey(pubkey))); // SetPubKey fails if this is not a valid public key, a case that would not be compressible
+        return CPubKey(pubkey).IsFullyValid(); // fails if this is not a valid public key, a case that would not be compressible
     }
     return false;
 }
@@ -1963,11 +2085,9 @@ bool CScriptCompressor::Decompress(unsigned int nSize, const std::vector<unsigne
         std::vector<unsigned char> vch(33, 0x00);
         vch[0] = nSize - 2;
         memcpy(&vch[1], &in[0], 32);
-        CKey key;
-        if (!key.SetPubKey(CPubKey(vch)))
+        CPubKey pubkey(vch);
+        if (!pubkey.Decompress())
             return false;
-        key.SetCompressedPubKey(false); // Decompress public key
-        CPubKey pubkey = key.GetPubKey();
         script.resize(67);
         script[0] = 65;
         memcpy(&script[1], &pubkey.Raw()[0], 65);
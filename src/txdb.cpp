@@ -7,15 +7,21 @@
 #include "txdb.h"
 #include "main.h"
 #include "hash.h"
+#include "headerhash.h"
+#include "ui_interface.h"
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
-}
+// Number of block index entries whose headers are hashed together at startup
+static const unsigned int LOAD_BLOCK_INDEX_BATCH = 1024;
+
+// Number of transactions converted per write when upgrading the coin database
+static const unsigned int UPGRADE_COINS_BATCH = 10000;
+
+// Transactions with up to this many outputs have their output records read
+// one by one; lookups of spent outputs are answered by the bloom filters,
+// which is cheaper than creating and seeking an iterator
+static const unsigned int COINS_POINT_READ_MAX = 16;
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
@@ -24,25 +30,97 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
-    return db.Read(make_pair('c', txid), coins); 
+// Write all of a CCoins: its header and every output record, and erase
+// records of outputs that no longer exist. fFresh means the views above
+// found nothing stored for txid, so there is nothing to erase; coinbase
+// txids can repeat, so their old records are always looked for.
+void CCoinsViewDB::BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoins &coins, bool fFresh) {
+    if (coins.fCoinBase)
+        fFresh = false;
+    unsigned int nOutputs = coins.vout.size();
+    if (!fFresh) {
+        CCoinsHeader header;
+        if (db.Read(make_pair('u', txid), header))
+            nOutputs = std::max(nOutputs, header.nOutputs);
+    }
+
+    if (coins.IsPruned())
+        batch.Erase(make_pair('u', txid));
+    else
+        batch.Write(make_pair('u', txid), CCoinsHeader(coins));
+    for (unsigned int n = 0; n < nOutputs; n++) {
+        if (coins.IsAvailable(n))
+            batch.Write(make_pair('o', make_pair(txid, n)), CTxOutCompressor(REF(coins.vout[n])));
+        else if (!fFresh)
+            batch.Erase(make_pair('o', make_pair(txid, n)));
+    }
+}
+
+bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
+    CCoinsHeader header;
+    if (!db.Read(make_pair('u', txid), header))
+        return false;
+
+    coins = CCoins();
+    coins.fCoinBase = header.fCoinBase;
+    coins.nHeight = header.nHeight;
+    coins.nVersion = header.nVersion;
+    coins.vout.resize(header.nOutputs);
+
+    if (header.nOutputs <= COINS_POINT_READ_MAX) {
+        for (unsigned int n = 0; n < header.nOutputs; n++) {
+            CTxOutCompressor txout(coins.vout[n]);
+            if (!db.Read(make_pair('o', make_pair(txid, n)), txout))
+                coins.vout[n].SetNull();
+        }
+        coins.Cleanup();
+        return true;
+    }
+
+    // The output records of a transaction are adjacent in key order
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('o', make_pair(txid, (unsigned int)0));
+    const size_t nPrefixSize = 1 + sizeof(uint256);
+    leveldb::Iterator *pcursor = db.NewIterator();
+    try {
+        for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() < nPrefixSize || memcmp(slKey.data(), &ssKeySet[0], nPrefixSize) != 0)
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            pair<char, pair<uint256, unsigned int> > key;
+            ssKey >> key;
+            if (key.second.second >= coins.vout.size())
+                coins.vout.resize(key.second.second + 1);
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CTxOutCompressor txout(coins.vout[key.second.second]);
+            ssValue >> txout;
+        }
+    } catch (std::exception &e) {
+        delete pcursor;
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    delete pcursor;
+    coins.Cleanup();
+    return true;
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
     CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
+    BatchWriteCoins(batch, txid, coins, false);
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
-    return db.Exists(make_pair('c', txid)); 
+    return db.Exists(make_pair('u', txid));
 }
 
 CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -54,18 +132,90 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    unsigned int nChanged = 0, nSpent = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
+        const CCoinsCacheEntry &entry = it->second;
+        if (entry.flags & CCoinsCacheEntry::DIRTY) {
+            BatchWriteCoins(batch, it->first, entry.coins, entry.flags & CCoinsCacheEntry::FRESH);
+            nChanged++;
+        } else if (entry.flags & CCoinsCacheEntry::SPENT) {
+            // Only some outputs were spent: delete just their records
+            BOOST_FOREACH(unsigned int n, entry.vSpent)
+                batch.Erase(make_pair('o', make_pair(it->first, n)));
+            if (entry.coins.IsPruned())
+                batch.Erase(make_pair('u', it->first));
+            nSpent++;
+        }
+    }
     if (pindex)
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
 
+    printf("Committing %u changed and %u spent-from transactions (out of %u) to coin database...\n", nChanged, nSpent, (unsigned int)mapCoins.size());
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade() {
+    leveldb::Iterator *pcursor = db.NewIterator();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'c';
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key().size() == 0 || pcursor->key()[0] != 'c') {
+        delete pcursor;
+        return true;
+    }
+
+    printf("Upgrading coin database to one record per output...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    int64 nStart = GetTimeMillis();
+    unsigned int nConverted = 0;
+    try {
+        CLevelDBBatch *pbatch = new CLevelDBBatch();
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != 'c')
+                break;
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+
+            // Each transaction moves in one batch, so an interrupted
+            // upgrade resumes where it stopped
+            BatchWriteCoins(*pbatch, txid, coins, true);
+            pbatch->Erase(make_pair('c', txid));
+            if (++nConverted % UPGRADE_COINS_BATCH == 0) {
+                if (!db.WriteBatch(*pbatch)) {
+                    delete pbatch;
+                    delete pcursor;
+                    return error("%s() : write failed", __PRETTY_FUNCTION__);
+                }
+                delete pbatch;
+                pbatch = new CLevelDBBatch();
+            }
+            pcursor->Next();
+        }
+        bool fOk = db.WriteBatch(*pbatch);
+        delete pbatch;
+        if (!fOk) {
+            delete pcursor;
+            return error("%s() : write failed", __PRETTY_FUNCTION__);
+        }
+    } catch (std::exception &e) {
+        delete pcursor;
+        return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+    }
+    delete pcursor;
+    printf("Upgraded %u transactions in %"PRI64d"ms\n", nConverted, GetTimeMillis() - nStart);
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -127,13 +277,12 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
+            if (chType == 'u') {
                 uint256 txhash;
                 ssKey >> txhash;
+                CCoins coins;
+                if (!GetCoins(txhash, coins))
+                    return error("%s() : cannot read %s", __PRETTY_FUNCTION__, txhash.ToString().c_str());
                 ss << txhash;
                 ss << VARINT(coins.nVersion);
                 ss << (coins.fCoinBase ? 'c' : 'n'); 
@@ -148,7 +297,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                         nTotalAmount += out.nValue;
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+                stats.nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
                 ss << VARINT(0);
             }
             pcursor->Next();
@@ -186,6 +335,53 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+// Add a batch of block index entries read from disk to mapBlockIndex,
+// hashing their headers together.
+static bool LoadBlockIndexBatch(const std::vector<CDiskBlockIndex> &vDiskIndex)
+{
+    std::vector<CBlockHeader> vHeaders(vDiskIndex.size());
+    for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+        const CDiskBlockIndex &diskindex = vDiskIndex[i];
+        CBlockHeader &header   = vHeaders[i];
+        header.nVersion        = diskindex.nVersion;
+        header.hashPrevBlock   = diskindex.hashPrev;
+        header.hashMerkleRoot  = diskindex.hashMerkleRoot;
+        header.nTime           = diskindex.nTime;
+        header.nBits           = diskindex.nBits;
+        header.nNonce          = diskindex.nNonce;
+    }
+    std::vector<uint256> vHashes(vDiskIndex.size());
+    if (!vHeaders.empty())
+        HashHeaders(&vHeaders[0], vHeaders.size(), &vHashes[0]);
+
+    for (unsigned int i = 0; i < vDiskIndex.size(); i++) {
+        const CDiskBlockIndex &diskindex = vDiskIndex[i];
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(vHashes[i]);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nDataPos       = diskindex.nDataPos;
+        pindexNew->nUndoPos       = diskindex.nUndoPos;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStatus        = diskindex.nStatus;
+        pindexNew->nTx            = diskindex.nTx;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && vHashes[i] == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex())
+            return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+    }
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -195,6 +391,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     pcursor->Seek(ssKeySet.str());
 
     // Load mapBlockIndex
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    vDiskIndex.reserve(LOAD_BLOCK_INDEX_BATCH);
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -205,30 +403,14 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
             if (chType == 'b') {
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+                vDiskIndex.push_back(CDiskBlockIndex());
+                ssValue >> vDiskIndex.back();
+
+                if (vDiskIndex.size() == LOAD_BLOCK_INDEX_BATCH) {
+                    if (!LoadBlockIndexBatch(vDiskIndex))
+                        return false;
+                    vDiskIndex.clear();
+                }
 
                 pcursor->Next();
             } else {
@@ -240,5 +422,8 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     }
     delete pcursor;
 
+    if (!LoadBlockIndexBatch(vDiskIndex))
+        return false;
+
     return true;
 }
\ No newline at end of file
@@ -8,20 +8,79 @@
 #include "main.h"
 #include "leveldb.h"
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** Per-transaction record of the coin database: everything in a CCoins
+ *  except the outputs, which are stored one record each.
+ *
+ *  Serialized format:
+ *  - VARINT(nVersion)
+ *  - VARINT(nHeight * 2 + fCoinBase)
+ *  - VARINT(nOutputs)
+ */
+class CCoinsHeader
+{
+public:
+    bool fCoinBase;
+    int nHeight;
+    int nVersion;
+    // one more than the highest output index that may have a record
+    unsigned int nOutputs;
+
+    CCoinsHeader() : fCoinBase(false), nHeight(0), nVersion(0), nOutputs(0) { }
+    CCoinsHeader(const CCoins &coins) : fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), nVersion(coins.nVersion), nOutputs(coins.vout.size()) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        return ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion) +
+               ::GetSerializeSize(VARINT(nCode), nType, nVersion) +
+               ::GetSerializeSize(VARINT(nOutputs), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
+        ::Serialize(s, VARINT(nCode), nType, nVersion);
+        ::Serialize(s, VARINT(nOutputs), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        ::Unserialize(s, VARINT(nOutputs), nType, nVersion);
+    }
+};
+
+/** CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ *  Each transaction with unspent outputs has a 'u' + txid record holding
+ *  its CCoinsHeader, and every unspent output a 'o' + txid + index record
+ *  holding the compressed CTxOut, so spending an output only deletes its
+ *  own record. Databases from before this layout store whole CCoins
+ *  under 'c' + txid; Upgrade() converts them.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+
+    void BatchWriteCoins(CLevelDBBatch &batch, const uint256 &txid, const CCoins &coins, bool fFresh);
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
+    // Convert a database in the old whole-CCoins layout, if needed
+    bool Upgrade();
+
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
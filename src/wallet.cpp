@@ -9,6 +9,7 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -86,6 +87,8 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    // Outputs already in the wallet may pay to the script
+    MarkDirty();
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -357,6 +360,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                 {
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
+                    setUnspent.erase(txin.prevout);
                     wtx.WriteToDisk();
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
@@ -369,8 +373,39 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        // Which outputs are ours may have changed too
+        setUnspent.clear();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            UpdateUnspent(item.first, item.second);
+        }
+    }
+}
+
+void CWallet::UpdateUnspent(const uint256& hash, const CWalletTx& wtx)
+{
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setUnspent.insert(COutPoint(hash, i));
+        else
+            setUnspent.erase(COutPoint(hash, i));
+    }
+}
+
+// The transactions with outputs in setUnspent; requires cs_wallet
+void CWallet::ListUnspentTxs(vector<const CWalletTx*>& vpcoin) const
+{
+    vpcoin.clear();
+    BOOST_FOREACH(const COutPoint& outpoint, setUnspent)
+    {
+        // Outputs of a transaction are next to each other in the set
+        if (!vpcoin.empty() && vpcoin.back()->GetHash() == outpoint.hash)
+            continue;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end())
+            vpcoin.push_back(&(*mi).second);
     }
 }
 
@@ -462,6 +497,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+            UpdateUnspent(hash, wtx);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
@@ -535,6 +573,9 @@ bool CWallet::EraseFromWallet(uint256 hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        set<COutPoint>::iterator it = setUnspent.lower_bound(COutPoint(hash, 0));
+        while (it != setUnspent.end() && (*it).hash == hash)
+            setUnspent.erase(it++);
     }
     return true;
 }
@@ -771,28 +812,180 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Reads the blocks of a rescan ahead on worker threads, which also find
+ * the transactions paying to the wallet's keys.  The caller takes the
+ * blocks in chain order and hands each back when it is done with it.
+ */
+class CWalletRescan
+{
+public:
+    struct CSlot
+    {
+        CBlock block;
+        std::vector<char> vfMine;   // which transactions pay to us
+        unsigned int nSize;
+        bool fReady;
+    };
+
+private:
+    const CWallet* pwallet;
+    const std::vector<CBlockIndex*>& vBlocks;
+    std::vector<CSlot> vSlots;      // block n is read into slot n % size
+    boost::mutex cs;
+    boost::condition_variable condReady;
+    boost::condition_variable condFree;
+    unsigned int nNextRead;
+    unsigned int nNextApply;
+    bool fStop;
+
+public:
+    CWalletRescan(const CWallet* pwalletIn, const std::vector<CBlockIndex*>& vBlocksIn, unsigned int nWindow) :
+        pwallet(pwalletIn), vBlocks(vBlocksIn), vSlots(nWindow), nNextRead(0), nNextApply(0), fStop(false)
+    {
+        for (unsigned int i = 0; i < vSlots.size(); i++)
+            vSlots[i].fReady = false;
+    }
+
+    void ThreadRead()
+    {
+        loop
+        {
+            unsigned int n;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (!fStop && nNextRead < vBlocks.size() && nNextRead >= nNextApply + vSlots.size())
+                    condFree.wait(lock);
+                if (fStop || nNextRead >= vBlocks.size())
+                    return;
+                n = nNextRead++;
+            }
+
+            // The slot is ours until it is marked ready
+            CSlot& slot = vSlots[n % vSlots.size()];
+            if (!slot.block.ReadFromDisk(vBlocks[n]))
+                slot.block.SetNull();
+            slot.nSize = ::GetSerializeSize(slot.block, SER_DISK, CLIENT_VERSION);
+            slot.vfMine.assign(slot.block.vtx.size(), false);
+            for (unsigned int i = 0; i < slot.block.vtx.size(); i++)
+            {
+                slot.vfMine[i] = pwallet->IsMine(slot.block.vtx[i]);
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                slot.fReady = true;
+            }
+            condReady.notify_all();
+        }
+    }
+
+    // Wait for block n, which must be the next one after those handed back
+    const CSlot& GetBlock(unsigned int n)
+    {
+        CSlot& slot = vSlots[n % vSlots.size()];
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!slot.fReady)
+            condReady.wait(lock);
+        return slot;
+    }
+
+    void FreeBlock(unsigned int n)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            CSlot& slot = vSlots[n % vSlots.size()];
+            slot.fReady = false;
+            slot.block.SetNull();
+            nNextApply = n + 1;
+        }
+        condFree.notify_all();
+    }
+
+    void Stop()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+        }
+        condFree.notify_all();
+    }
+};
+
+// Whether tx has to go through AddToWalletIfInvolvingMe during a rescan: it
+// pays to us, is in the wallet already, or spends from the wallet
+bool CWallet::IsRescanCandidate(const CTransaction& tx, const uint256& hash, bool fMine) const
+{
+    if (fMine || mapWallet.count(hash))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (mapWallet.count(txin.prevout.hash))
+            return true;
+    return false;
+}
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
-
-    CBlockIndex* pindex = pindexStart;
+    int64 nStart = GetTimeMillis();
+
+    vector<CBlockIndex*> vBlocks;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+        vBlocks.push_back(pindex);
+    if (vBlocks.empty())
+        return 0;
+
+    // Blocks are read and matched against our keys on worker threads, while
+    // this thread adds what they found in chain order, as before
+    int nThreads = std::max((int)boost::thread::hardware_concurrency(), 1);
+    CWalletRescan rescan(this, vBlocks, WALLET_RESCAN_WINDOW);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CWalletRescan::ThreadRead, &rescan));
+
+    uint64 nBytes = 0;
+    int64 nLastProgress = nStart;
+    try
     {
         LOCK(cs_wallet);
-        while (pindex)
+        for (unsigned int n = 0; n < vBlocks.size(); n++)
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            const CWalletRescan::CSlot& slot = rescan.GetBlock(n);
+            for (unsigned int i = 0; i < slot.block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const CTransaction& tx = slot.block.vtx[i];
+                uint256 hash = tx.GetHash();
+                if (IsRescanCandidate(tx, hash, slot.vfMine[i]) &&
+                    AddToWalletIfInvolvingMe(hash, tx, &slot.block, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+            nBytes += slot.nSize;
+            rescan.FreeBlock(n);
+
+            int64 nNow = GetTimeMillis();
+            if (nNow - nLastProgress >= 10000)
+            {
+                printf("Rescan: block %d (%u of %"PRIszu", %d%%), %.0f blocks/s, %.1f MB/s\n",
+                       vBlocks[n]->nHeight, n + 1, vBlocks.size(), (int)((uint64)(n + 1) * 100 / vBlocks.size()),
+                       (n + 1) * 1000.0 / (nNow - nStart), nBytes / 1000.0 / (nNow - nStart));
+                nLastProgress = nNow;
+            }
         }
     }
+    catch (...)
+    {
+        rescan.Stop();
+        threadGroup.join_all();
+        throw;
+    }
+    rescan.Stop();
+    threadGroup.join_all();
+
+    int64 nTime = std::max(GetTimeMillis() - nStart, (int64)1);
+    printf("Rescanned %"PRIszu" blocks from height %d in %"PRI64d"ms (%.0f blocks/s, %.1f MB/s), %d transactions found\n",
+           vBlocks.size(), pindexStart->nHeight, nTime, vBlocks.size() * 1000.0 / nTime, nBytes / 1000.0 / nTime, ret);
     return ret;
 }
 
@@ -823,6 +1016,7 @@ void CWallet::ReacceptWalletTransactions()
                     if ((i >= coins.vout.size() || coins.vout[i].IsNull()) && IsMine(wtx.vout[i]))
                     {
                         wtx.MarkSpent(i);
+                        setUnspent.erase(COutPoint(wtx.GetHash(), i));
                         fUpdated = true;
                         fMissing = true;
                     }
@@ -859,14 +1053,14 @@ void CWalletTx::RelayWalletTransaction()
         // banned when retransmitted, hence the check for !tx.vin.empty()
         if (!tx.IsCoinBase() && !tx.vin.empty())
             if (tx.GetDepthInMainChain() == 0)
-                RelayTransaction((CTransaction)tx, tx.GetHash());
+                RelayTransaction((const CTransaction&)tx, tx.GetHash());
     }
     if (!IsCoinBase())
     {
         if (GetDepthInMainChain() == 0) {
             uint256 hash = GetHash();
             printf("Relaying wtx %s\n", hash.ToString().c_str());
-            RelayTransaction((CTransaction)*this, hash);
+            RelayTransaction((const CTransaction&)*this, hash);
         }
     }
 }
@@ -927,9 +1121,10 @@ int64 CWallet::GetBalance() const
     int64 nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<const CWalletTx*> vpcoin;
+        ListUnspentTxs(vpcoin);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpcoin)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsConfirmed())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -943,9 +1138,10 @@ int64 CWallet::GetUnconfirmedBalance() const
     int64 nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<const CWalletTx*> vpcoin;
+        ListUnspentTxs(vpcoin);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpcoin)
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -958,9 +1154,10 @@ int64 CWallet::GetImmatureBalance() const
     int64 nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<const CWalletTx*> vpcoin;
+        ListUnspentTxs(vpcoin);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpcoin)
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -974,10 +1171,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed) const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        vector<const CWalletTx*> vpcoin;
+        ListUnspentTxs(vpcoin);
+        BOOST_FOREACH(const CWalletTx* pcoin, vpcoin)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
             if (!pcoin->IsFinal())
                 continue;
 
@@ -987,17 +1184,41 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed) const
             if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
                 continue;
 
+            uint256 hash = pcoin->GetHash();
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0)
+                if (setUnspent.count(COutPoint(hash, i)) &&
+                    !IsLockedCoin(hash, i) && pcoin->vout[i].nValue > 0)
                     vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
             }
         }
     }
 }
 
+// Bytes an input spending one of our outputs adds to a transaction: outpoint,
+// script length, <65-byte signature> <65-byte public key>, sequence
+static const unsigned int WALLET_INPUT_SIZE = 36 + 1 + 132 + 4;
+// Bytes a pay-to-pubkey-hash output adds: value, script length, script
+static const unsigned int WALLET_OUTPUT_SIZE = 8 + 1 + 25;
+// Most branches the search for a selection without change may visit
+static const unsigned int WALLET_BNB_MAX_TRIES = 100000;
+
+// Fee per kilobyte CreateTransaction pays for transactions that are not free
+static int64 GetWalletFeeRate()
+{
+    return max(nTransactionFee, CTransaction::nMinTxFee);
+}
+
+// Change below this is added to the fee: it would cost more to create and
+// later spend than it is worth, or it would be dust (see CTxOut::IsDust)
+static int64 GetCostOfChange()
+{
+    int64 nCost = GetWalletFeeRate() * (WALLET_OUTPUT_SIZE + WALLET_INPUT_SIZE) / 1000;
+    int64 nDust = CTransaction::nMinRelayTxFee * 3 * (WALLET_OUTPUT_SIZE + 148) / 1000;
+    return max(nCost, nDust);
+}
+
 static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
-                                  vector<char>& vfBest, int64& nBest, int iterations = 1000)
+                                  vector<char>& vfBest, int64& nBest, int64 nDeadline, int iterations = 1000)
 {
     vector<char> vfIncluded;
 
@@ -1008,6 +1229,10 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
+        // Every pass looks at every coin, so with many coins stop at the deadline
+        if (nRep > 0 && GetTimeMillis() > nDeadline)
+            break;
+
         vfIncluded.assign(vValue.size(), false);
         int64 nTotal = 0;
         bool fReachedTarget = false;
@@ -1042,7 +1267,75 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+// Depth-first branch and bound search for coins adding up to between
+// nTargetValue and nTargetValue + nCostOfChange, so that the transaction needs
+// no change output; the smallest excess wins.  vValue must be sorted largest
+// first.  Gives up after WALLET_BNB_MAX_TRIES branches or at nDeadline.
+static bool SelectCoinsBnB(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                           int64 nCostOfChange, int64 nDeadline, vector<char>& vfBest, int64& nBest)
+{
+    vector<char> vfSelected(vValue.size(), false);
+    unsigned int nDepth = 0;    // coins decided on so far
+    int64 nSelected = 0;        // value of those selected
+    int64 nRemaining = 0;       // value of those not decided on yet
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nRemaining += vValue[i].first;
+
+    bool fFound = false;
+    int64 nBestExcess = std::numeric_limits<int64>::max();
+    for (unsigned int nTries = 0; nTries < WALLET_BNB_MAX_TRIES; nTries++)
+    {
+        if ((nTries & 1023) == 1023 && GetTimeMillis() > nDeadline)
+            break;
+
+        bool fBacktrack = false;
+        if (nSelected + nRemaining < nTargetValue || nSelected > nTargetValue + nCostOfChange)
+            fBacktrack = true;
+        else if (nSelected >= nTargetValue)
+        {
+            int64 nExcess = nSelected - nTargetValue;
+            if (nExcess < nBestExcess)
+            {
+                nBestExcess = nExcess;
+                vfBest = vfSelected;
+                nBest = nSelected;
+                fFound = true;
+                if (nExcess == 0)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            // Undo the coins left out since the last one selected, and try
+            // leaving that one out instead
+            while (nDepth > 0 && !vfSelected[nDepth - 1])
+            {
+                nDepth--;
+                nRemaining += vValue[nDepth].first;
+            }
+            if (nDepth == 0)
+                break;
+            vfSelected[nDepth - 1] = false;
+            nSelected -= vValue[nDepth - 1].first;
+            continue;
+        }
+
+        // Select the next coin, unless the one before had the same value and
+        // was left out: that selection has been tried already
+        nRemaining -= vValue[nDepth].first;
+        if (nDepth == 0 || vfSelected[nDepth - 1] || vValue[nDepth].first != vValue[nDepth - 1].first)
+        {
+            vfSelected[nDepth] = true;
+            nSelected += vValue[nDepth].first;
+        }
+        nDepth++;
+    }
+    return fFound;
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1055,9 +1348,10 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Coins worth no more than the fee for spending them are left out
+    int64 nInputFee = GetWalletFeeRate() * WALLET_INPUT_SIZE / 1000;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1066,6 +1360,8 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         int i = output.i;
         int64 n = pcoin->vout[i].nValue;
+        if (n <= nInputFee)
+            continue;
 
         pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
 
@@ -1105,14 +1401,32 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // Coins of equal value are tried in random order
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
+    stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
+    int64 nSearchTime = GetArg("-coinselecttime", DEFAULT_COIN_SELECT_TIME);
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+    // Prefer a selection that needs no change
+    if (SelectCoinsBnB(vValue, nTargetValue, GetCostOfChange(), GetTimeMillis() + nSearchTime, vfBest, nBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        if (fDebug)
+            printf("SelectCoins() selection without change: %"PRIszu" coins, total %s\n", setCoinsRet.size(), FormatMoney(nBest).c_str());
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation
+    int64 nDeadline = GetTimeMillis() + nSearchTime;
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nDeadline, 1000);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nDeadline, 1000);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1141,14 +1455,48 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     return true;
 }
 
-bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+bool CWallet::SelectCoins(int64 nTargetValue, unsigned int nOutputs, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     vector<COutput> vCoins;
     AvailableCoins(vCoins);
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet));
+    if (!(SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
+          SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
+          SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)))
+        return false;
+
+    if (GetBoolArg("-consolidatecoins"))
+        AddConsolidationCoins(vCoins, nOutputs, setCoinsRet, nValueRet);
+    return true;
+}
+
+// Fees are paid per started kilobyte, so until the transaction reaches the
+// next kilobyte more inputs cost nothing: fill that room with the smallest
+// confirmed coins to sweep up dust.
+void CWallet::AddConsolidationCoins(const vector<COutput>& vCoins, unsigned int nOutputs,
+                                    set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
+{
+    unsigned int nBytes = 10 + nOutputs * WALLET_OUTPUT_SIZE + setCoinsRet.size() * WALLET_INPUT_SIZE;
+    unsigned int nRoom = 999 - nBytes % 1000;
+    if (nRoom < WALLET_INPUT_SIZE)
+        return;
+
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
+    BOOST_FOREACH(const COutput& output, vCoins)
+    {
+        pair<const CWalletTx*,unsigned int> coin(output.tx, output.i);
+        if (output.nDepth >= 1 && !setCoinsRet.count(coin))
+            vValue.push_back(make_pair(output.tx->vout[output.i].nValue, coin));
+    }
+    unsigned int nAdd = std::min((unsigned int)vValue.size(), nRoom / WALLET_INPUT_SIZE);
+    partial_sort(vValue.begin(), vValue.begin() + nAdd, vValue.end(), CompareValueOnly());
+    for (unsigned int i = 0; i < nAdd; i++)
+    {
+        setCoinsRet.insert(vValue[i].second);
+        nValueRet += vValue[i].first;
+    }
+    if (nAdd > 0)
+        printf("SelectCoins() consolidating %u small coins\n", nAdd);
 }
 
 
@@ -1183,6 +1531,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
             {
                 wtxNew.vin.clear();
                 wtxNew.vout.clear();
+                wtxNew.InvalidateHash();
                 wtxNew.fFromMe = true;
 
                 int64 nTotalValue = nValue + nFeeRet;
@@ -1202,7 +1551,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64 nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn))
+                if (!SelectCoins(nTotalValue, wtxNew.vout.size() + 1, setCoins, nValueIn))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1227,6 +1576,14 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     nFeeRet += nMoveToFee;
                 }
 
+                // Change worth less than it costs to create and spend later
+                // goes to the fee too
+                if (nChange > 0 && nChange < GetCostOfChange())
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
+
                 if (nChange > 0)
                 {
                     // Note: We use a new key here to keep it from being obvious which side is the change.
@@ -1279,7 +1636,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     }
 
                 // Limit size
-                unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                unsigned int nBytes = wtxNew.GetTxSize();
                 if (nBytes >= MAX_STANDARD_TX_SIZE)
                 {
                     strFailReason = _("Transaction too large");
@@ -1342,6 +1699,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 CWalletTx &coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
+                setUnspent.erase(txin.prevout);
                 coin.WriteToDisk();
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
@@ -1438,6 +1796,12 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            UpdateUnspent(item.first, item.second);
+    }
+
     return DB_LOAD_OK;
 }
 
@@ -24,6 +24,11 @@ class CWalletTx;
 class CReserveKey;
 class COutput;
 
+/** Default for -coinselecttime, milliseconds for each coin selection search */
+static const int64 DEFAULT_COIN_SELECT_TIME = 100;
+/** Number of blocks a rescan reads ahead of the one it is adding transactions from */
+static const unsigned int WALLET_RESCAN_WINDOW = 64;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -69,7 +74,8 @@ public:
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoins(int64 nTargetValue, unsigned int nOutputs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    void AddConsolidationCoins(const std::vector<COutput>& vCoins, unsigned int nOutputs, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -79,6 +85,13 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Our outputs in mapWallet that are not marked spent; balances and coin
+    // selection look only at their transactions instead of the whole history
+    std::set<COutPoint> setUnspent;
+
+    void UpdateUnspent(const uint256& hash, const CWalletTx& wtx);
+    void ListUnspentTxs(std::vector<const CWalletTx*>& vpcoin) const;
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -126,7 +139,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -139,7 +152,7 @@ public:
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    bool LoadKey(const CSecret& vchSecret, const CPubKey& vchPubKey) { return CCryptoKeyStore::AddKeyPubKey(vchSecret, vchPubKey); }
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
@@ -174,6 +187,7 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    bool IsRescanCandidate(const CTransaction& tx, const uint256& hash, bool fMine) const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
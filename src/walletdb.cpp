@@ -6,8 +6,10 @@
 
 #include "walletdb.h"
 #include "wallet.h"
+#include "ui_interface.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -183,10 +185,16 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// Key records whose secrets are still to be checked against their public keys
+typedef vector<pair<CPubKey, CSecret> > KeyCheckList;
+// Keys a thread checks between looking at the shared progress
+static const unsigned int WALLET_KEY_CHECK_BATCH = 256;
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
-             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr)
+             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr,
+             KeyCheckList* pvKeysToCheck = NULL)
 {
     try {
         // Unserialize
@@ -266,50 +274,30 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             vector<unsigned char> vchPubKey;
             ssKey >> vchPubKey;
-            CKey key;
+            CSecret vchSecret;
             if (strType == "key")
-            {
-                CSecret pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetSecret(pkey))
-                {
-                    strErr = "Error reading wallet database: CSecret corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CSecret pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CSecret";
-                    return false;
-                }
-            }
+                ssValue >> vchSecret;
             else
             {
                 CWalletKey wkey;
                 ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetSecret(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CSecret corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
+                vchSecret = wkey.vchPrivKey;
+            }
+            if (vchSecret.size() != SCHNORR_SECRET_KEY_SIZE)
+            {
+                strErr = "Error reading wallet database: CSecret corrupt";
+                return false;
             }
-            if (!pwallet->LoadKey(key))
+            // Deriving the public key is the slow part of loading a wallet;
+            // leave it to the caller if it wants to do it in bulk
+            if (pvKeysToCheck)
+                pvKeysToCheck->push_back(make_pair(CPubKey(vchPubKey), vchSecret));
+            else if (!CKey::CheckSecret(vchSecret, vchPubKey))
+            {
+                strErr = "Error reading wallet database: CSecret pubkey inconsistency";
+                return false;
+            }
+            if (!pwallet->LoadKey(vchSecret, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -388,6 +376,98 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** Checks the secrets of key records against their public keys on all cores,
+ * a batch at a time.
+ */
+class CWalletKeyChecker
+{
+private:
+    const KeyCheckList& vKeys;
+    boost::mutex cs;
+    unsigned int nNext;
+    unsigned int nChecked;
+    bool fOK;
+
+public:
+    CWalletKeyChecker(const KeyCheckList& vKeysIn) : vKeys(vKeysIn), nNext(0), nChecked(0), fOK(true) {}
+
+    // Check the next batch; returns false when there is nothing left to do
+    bool CheckBatch()
+    {
+        unsigned int nBegin, nEnd;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (!fOK || nNext >= vKeys.size())
+                return false;
+            nBegin = nNext;
+            nEnd = nNext = std::min(nNext + WALLET_KEY_CHECK_BATCH, (unsigned int)vKeys.size());
+        }
+
+        bool fBatchOK = true;
+        for (unsigned int i = nBegin; i < nEnd; i++)
+        {
+            if (!CKey::CheckSecret(vKeys[i].second, vKeys[i].first))
+            {
+                printf("Error reading wallet database: CSecret pubkey inconsistency for %s\n",
+                       CBitcoinAddress(vKeys[i].first.GetID()).ToString().c_str());
+                fBatchOK = false;
+                break;
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        nChecked += nEnd - nBegin;
+        fOK = fOK && fBatchOK;
+        return true;
+    }
+
+    void ThreadCheck()
+    {
+        while (CheckBatch())
+            ;
+    }
+
+    int GetProgress()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return vKeys.empty() ? 100 : (int)((uint64)nChecked * 100 / vKeys.size());
+    }
+
+    bool IsOK()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return fOK;
+    }
+};
+
+static bool CheckWalletKeys(const KeyCheckList& vKeys)
+{
+    int64 nStart = GetTimeMillis();
+    CWalletKeyChecker checker(vKeys);
+
+    int nThreads = boost::thread::hardware_concurrency();
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CWalletKeyChecker::ThreadCheck, &checker));
+
+    // This thread checks too, and reports progress between batches
+    int nLastProgress = -1;
+    while (checker.CheckBatch())
+    {
+        int nProgress = checker.GetProgress();
+        if (nProgress / 10 != nLastProgress / 10)
+        {
+            uiInterface.InitMessage(strprintf(_("Checking wallet keys... %d%%"), nProgress));
+            nLastProgress = nProgress;
+        }
+    }
+    threadGroup.join_all();
+
+    printf("Checked %"PRIszu" wallet keys on %d threads in %"PRI64d"ms\n",
+           vKeys.size(), std::max(nThreads, 1), GetTimeMillis() - nStart);
+    return checker.IsOK();
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -397,6 +477,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fAnyUnordered = false;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    KeyCheckList vKeysToCheck;
 
     try {
         LOCK(pwallet->cs_wallet);
@@ -433,7 +514,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
             if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr,
+                              &vKeysToCheck))
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -452,6 +534,10 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 printf("%s\n", strErr.c_str());
         }
         pcursor->close();
+
+        // Losing keys is catastrophic here too
+        if (!vKeysToCheck.empty() && !CheckWalletKeys(vKeysToCheck))
+            result = DB_CORRUPT;
     }
     catch (boost::thread_interrupted) {
         throw;